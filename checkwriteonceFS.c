@@ -0,0 +1,450 @@
+/**
+ * File: checkwriteonceFS.c
+ * Authors: Vikram Sahai Saxena(vs799), Vishwas Gowdihalli Mahalingappa(vg421)
+ * Behavior checks for writeonceFS, every file is verified again after a remount.
+ * All checks run with buffered I/O, then with O_DIRECT (which falls back to buffered I/O where the
+ * file system refuses it) and with O_DIRECT from a huge page arena.
+ * The trace check runs ./replay, so run from the directory holding both programs.
+ * Usage: ./check
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define BLOCK_CHUNK_SIZE 1024
+#define NO_OF_FILES 50
+#define MAX_FILE_SIZE (2048 * BLOCK_CHUNK_SIZE)
+
+typedef enum {WO_CREAT = 1} mode;
+typedef enum {WO_RDONLY = 2, WO_WRONLY = 3, WO_RDWR = 4} flags;
+typedef enum {WO_BUFFERED = 0, WO_DIRECT = 1, WO_HUGE_PAGES = 2} io_mode;
+
+int wo_mount(char* file_name, void* mem_address);
+int wo_mount_striped(char** file_names, int count, int unit, void* mem_address);
+int wo_unmount(void* mem_address);
+int wo_open(char* file_name, flags fl, mode m);
+int wo_read(int fd, void* buffer, int bytes);
+int wo_write(int fd, void* buffer, int bytes);
+int wo_close(int fd);
+int wo_sync(int fd);
+int wo_defrag(int max_usec);
+int wo_clone(char* src_name, char* dst_name);
+int wo_fallocate(int fd, int len);
+int wo_set_io_mode(int mode_flags);
+int wo_trace_start(char *log_name);
+int wo_trace_stop();
+
+static char *disk_name = "check_disk.txt";
+static char *trace_name = "check_trace.txt";
+static int failures = 0;
+static char *pass_name = "buffered"; //I/O mode of the current pass
+static char read_buf[MAX_FILE_SIZE + 1];
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed (%s): %s\n", __FILE__, __LINE__, pass_name, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+//fill a buffer with bytes that differ per seed and per position
+static void fill(char *buffer, int len, int seed) {
+    for (int i = 0; i < len; i++) {
+        buffer[i] = (char)('!' + (i / 7 + seed * 13) % 90);
+    }
+}
+
+//create a file holding len bytes of data
+static void create_file(char *name, char *data, int len) {
+    int fd = wo_open(name, WO_RDWR, WO_CREAT);
+    CHECK(0 <= fd);
+    CHECK(len == wo_write(fd, data, len));
+    CHECK(0 == wo_close(fd));
+}
+
+//overwrite the start of a file, or append to it, with len bytes of data
+static void write_file(char *name, char *data, int len, int append) {
+    int fd = wo_open(name, WO_RDWR, 0);
+    CHECK(0 <= fd);
+    if (append) {
+        wo_read(fd, read_buf, MAX_FILE_SIZE);
+    }
+    CHECK(len == wo_write(fd, data, len));
+    CHECK(0 == wo_close(fd));
+}
+
+//check a file holds exactly len bytes of data
+static void verify_file(char *name, char *data, int len) {
+    int fd = wo_open(name, WO_RDONLY, 0);
+    CHECK(0 <= fd);
+    if (0 > fd) {
+        return;
+    }
+    int count = wo_read(fd, read_buf, sizeof(read_buf));
+    CHECK(len == count || (0 == len && 0 > count));
+    CHECK(0 >= len || 0 == memcmp(read_buf, data, len));
+    CHECK(0 == wo_close(fd));
+}
+
+static void remount() {
+    CHECK(0 == wo_unmount(NULL));
+    CHECK(0 == wo_mount(disk_name, NULL));
+}
+
+//every inode survives a remount, a full inode table refuses new files
+static void check_remount() {
+    static char data[NO_OF_FILES][4 * BLOCK_CHUNK_SIZE];
+    char name[16];
+    unlink(disk_name);
+    CHECK(0 == wo_mount(disk_name, NULL));
+    for (int i = 0; i < NO_OF_FILES; i++) {
+        snprintf(name, sizeof(name), "file%d", i);
+        fill(data[i], (i % 4 + 1) * BLOCK_CHUNK_SIZE - i, i);
+        create_file(name, data[i], (i % 4 + 1) * BLOCK_CHUNK_SIZE - i);
+    }
+    CHECK(-ENOSPC == wo_open("one_too_many", WO_RDWR, WO_CREAT));
+    remount();
+    for (int i = 0; i < NO_OF_FILES; i++) {
+        snprintf(name, sizeof(name), "file%d", i);
+        verify_file(name, data[i], (i % 4 + 1) * BLOCK_CHUNK_SIZE - i);
+    }
+    CHECK(0 == wo_unmount(NULL));
+}
+
+//defragmenting interleaved files keeps their contents, also when writes come in between steps and
+//a fragmented file takes several steps to move
+static void check_defrag() {
+    static char data[4][800 * BLOCK_CHUNK_SIZE];
+    char *names[4] = {"frag0", "frag1", "frag2", "frag3"};
+    int sizes[4] = {800 * BLOCK_CHUNK_SIZE, 800 * BLOCK_CHUNK_SIZE, 200 * BLOCK_CHUNK_SIZE, 0};
+    unlink(disk_name);
+    CHECK(0 == wo_mount(disk_name, NULL));
+    int fds[4];
+    for (int f = 0; f < 4; f++) {
+        fill(data[f], sizeof(data[f]), 100 + f);
+        fds[f] = wo_open(names[f], WO_RDWR, WO_CREAT);
+        CHECK(0 <= fds[f]);
+    }
+
+    //the small file only starts growing once free space is scarce, so it ends up fragmented
+    for (int i = 0; i < 800; i++) {
+        for (int f = 0; f < 3; f++) {
+            int pos = (i - 800) * BLOCK_CHUNK_SIZE + sizes[f];
+            if (0 <= pos) {
+                CHECK(BLOCK_CHUNK_SIZE == wo_write(fds[f], data[f] + pos, BLOCK_CHUNK_SIZE));
+                CHECK(0 == wo_sync(fds[f]));
+            }
+        }
+    }
+    for (int f = 0; f < 3; f++) {
+        CHECK(0 == wo_close(fds[f]));
+    }
+    int steps = 0;
+    int more;
+    while (0 < (more = wo_defrag(1)) && 10000 > steps) {
+        if (0 == steps % 5 && 40 * BLOCK_CHUNK_SIZE > sizes[3]) {
+            CHECK(BLOCK_CHUNK_SIZE == wo_write(fds[3], data[3] + sizes[3], BLOCK_CHUNK_SIZE));
+            CHECK(0 == wo_sync(fds[3]));
+            sizes[3] += BLOCK_CHUNK_SIZE;
+        }
+        steps++;
+    }
+    CHECK(0 == more);
+    CHECK(0 == wo_close(fds[3]));
+    for (int f = 0; f < 4; f++) {
+        verify_file(names[f], data[f], sizes[f]);
+    }
+    remount();
+    for (int f = 0; f < 4; f++) {
+        verify_file(names[f], data[f], sizes[f]);
+    }
+    CHECK(0 == wo_unmount(NULL));
+}
+
+//clones and their source keep their own contents through writes to either side, defrag and remount
+static void check_clone() {
+    static char source[24 * BLOCK_CHUNK_SIZE], tail[6 * BLOCK_CHUNK_SIZE], head[3 * BLOCK_CHUNK_SIZE];
+    static char appended[sizeof(source) + sizeof(tail)], overwritten[sizeof(source)];
+    fill(source, sizeof(source), 200);
+    fill(tail, sizeof(tail), 201);
+    fill(head, sizeof(head) - 100, 202);
+    memcpy(appended, source, sizeof(source));
+    memcpy(appended + sizeof(source), tail, sizeof(tail));
+    memcpy(overwritten, source, sizeof(source));
+    memcpy(overwritten, head, sizeof(head) - 100);
+    unlink(disk_name);
+    CHECK(0 == wo_mount(disk_name, NULL));
+    create_file("source", source, sizeof(source));
+    CHECK(0 == wo_clone("source", "clone1"));
+    CHECK(0 == wo_clone("source", "clone2"));
+    CHECK(-EEXIST == wo_clone("source", "clone1"));
+    CHECK(-ENOENT == wo_clone("missing", "clone3"));
+    verify_file("clone1", source, sizeof(source));
+    verify_file("clone2", source, sizeof(source));
+
+    //writing a clone leaves the source and the other clone untouched
+    write_file("clone1", tail, sizeof(tail), 1);
+    verify_file("clone1", appended, sizeof(appended));
+    verify_file("source", source, sizeof(source));
+    verify_file("clone2", source, sizeof(source));
+
+    //writing the source hands its blocks over to the remaining clone
+    write_file("source", head, sizeof(head) - 100, 0);
+    verify_file("source", overwritten, sizeof(overwritten));
+    verify_file("clone2", source, sizeof(source));
+    CHECK(0 == wo_clone("clone2", "clone3"));
+    remount();
+    verify_file("source", overwritten, sizeof(overwritten));
+    verify_file("clone1", appended, sizeof(appended));
+    verify_file("clone2", source, sizeof(source));
+    verify_file("clone3", source, sizeof(source));
+
+    //defrag moves shared blocks without breaking either side
+    while (0 < wo_defrag(1000));
+    write_file("clone3", tail, sizeof(tail), 1);
+    verify_file("clone3", appended, sizeof(appended));
+    verify_file("clone2", source, sizeof(source));
+    remount();
+    verify_file("source", overwritten, sizeof(overwritten));
+    verify_file("clone1", appended, sizeof(appended));
+    verify_file("clone2", source, sizeof(source));
+    verify_file("clone3", appended, sizeof(appended));
+    CHECK(0 == wo_unmount(NULL));
+}
+
+//failed mounts release everything they took, so later mounts still work
+static void check_mount_errors() {
+    unlink(disk_name);
+    CHECK(0 == wo_mount(disk_name, NULL));
+    CHECK(0 == wo_unmount(NULL));
+    CHECK(-ENOENT == wo_unmount(NULL));
+    char *names[2] = {disk_name, "check_stripe.txt"};
+    for (int i = 0; i < 100; i++) {
+        CHECK(-EINVAL == wo_mount_striped(names, 2, 4, NULL));
+    }
+    CHECK(0 == wo_mount(disk_name, NULL));
+    CHECK(0 == wo_unmount(NULL));
+}
+
+//overwrites inside a file, apart from each other and across its end keep the bytes around them
+static void check_overwrite() {
+    static char data[40 * BLOCK_CHUNK_SIZE + 300], patch[3 * BLOCK_CHUNK_SIZE];
+    fill(data, sizeof(data), 600);
+    fill(patch, sizeof(patch), 601);
+    unlink(disk_name);
+    CHECK(0 == wo_mount(disk_name, NULL));
+    create_file("patched", data, 40000);
+    int fd = wo_open("patched", WO_RDWR, 0);
+    CHECK(0 <= fd);
+    CHECK(1500 == wo_read(fd, read_buf, 1500));
+    CHECK(3000 == wo_write(fd, patch, 3000));
+    memcpy(data + 1500, patch, 3000);
+    CHECK(15000 == wo_read(fd, read_buf, 15000));
+    CHECK(10 == wo_write(fd, patch + 7, 10));
+    memcpy(data + 19500, patch + 7, 10);
+    CHECK(20000 == wo_read(fd, read_buf, 20000));
+    CHECK(BLOCK_CHUNK_SIZE == wo_write(fd, patch, BLOCK_CHUNK_SIZE));
+    memcpy(data + 39510, patch, BLOCK_CHUNK_SIZE);
+    CHECK(0 == wo_close(fd));
+    verify_file("patched", data, 39510 + BLOCK_CHUNK_SIZE);
+    remount();
+    verify_file("patched", data, 39510 + BLOCK_CHUNK_SIZE);
+    CHECK(0 == wo_unmount(NULL));
+}
+
+//a full disk refuses writes up front, so closes and unmounts still succeed and nothing is lost
+static void check_full_disk() {
+    static char data[4][500 * BLOCK_CHUNK_SIZE], extra[100 * BLOCK_CHUNK_SIZE];
+    char *names[4] = {"full0", "full1", "full2", "full3"};
+    unlink(disk_name);
+    CHECK(0 == wo_mount(disk_name, NULL));
+    for (int f = 0; f < 4; f++) {
+        fill(data[f], sizeof(data[f]), 500 + f);
+        create_file(names[f], data[f], sizeof(data[f]));
+    }
+    fill(extra, sizeof(extra), 504);
+    int fd = wo_open("extra", WO_RDWR, WO_CREAT);
+    CHECK(0 <= fd);
+    int len = 0;
+    while (len < (int)sizeof(extra) && BLOCK_CHUNK_SIZE == wo_write(fd, extra + len, BLOCK_CHUNK_SIZE)) {
+        len += BLOCK_CHUNK_SIZE;
+    }
+    CHECK(0 < len && len < (int)sizeof(extra));
+    CHECK(-ENOSPC == wo_write(fd, extra + len, BLOCK_CHUNK_SIZE));
+    CHECK(0 == wo_close(fd));
+
+    //a clone needs blocks of its own before it can be written
+    CHECK(0 == wo_clone(names[0], "full_copy"));
+    fd = wo_open("full_copy", WO_RDWR, 0);
+    CHECK(-ENOSPC == wo_write(fd, extra, BLOCK_CHUNK_SIZE));
+    CHECK(0 == wo_close(fd));
+    remount();
+    for (int f = 0; f < 4; f++) {
+        verify_file(names[f], data[f], sizeof(data[f]));
+    }
+    verify_file("extra", extra, len);
+    verify_file("full_copy", data[0], sizeof(data[0]));
+    CHECK(0 == wo_unmount(NULL));
+}
+
+//the caller's memory for the disk structures need not be block aligned, direct I/O bounces it
+static void check_user_memory() {
+    static char mem[4 * BLOCK_CHUNK_SIZE + 1], data[5000];
+    fill(data, sizeof(data), 700);
+    unlink(disk_name);
+    CHECK(0 == wo_mount(disk_name, mem + 1));
+    create_file("user_mem", data, sizeof(data));
+    CHECK(0 == wo_unmount(mem + 1));
+    CHECK(0 == wo_mount(disk_name, mem + 1));
+    verify_file("user_mem", data, sizeof(data));
+    CHECK(0 == wo_unmount(mem + 1));
+}
+
+//reserved space keeps the file size, appends fill it across syncs, clones and remounts
+static void check_fallocate() {
+    static char data[120 * BLOCK_CHUNK_SIZE], other[20 * BLOCK_CHUNK_SIZE];
+    fill(data, sizeof(data), 400);
+    fill(other, sizeof(other), 401);
+    unlink(disk_name);
+    CHECK(0 == wo_mount(disk_name, NULL));
+    create_file("reserved", data, 1500);
+    int fd = wo_open("reserved", WO_RDWR, 0);
+    CHECK(0 <= fd);
+    CHECK(-EINVAL == wo_fallocate(fd, 0));
+    CHECK(-EFBIG == wo_fallocate(fd, 8 * 1024 * 1024));
+    CHECK(-ENOENT == wo_fallocate(fd + 1, BLOCK_CHUNK_SIZE));
+    CHECK(0 == wo_fallocate(fd, sizeof(data)));
+    CHECK(0 == wo_fallocate(fd, BLOCK_CHUNK_SIZE));
+    CHECK(0 == wo_close(fd));
+    verify_file("reserved", data, 1500);
+
+    //a reservation survives a remount and is filled while another file grows
+    remount();
+    create_file("other", other, sizeof(other));
+    fd = wo_open("reserved", WO_RDWR, 0);
+    CHECK(1500 == wo_read(fd, read_buf, MAX_FILE_SIZE));
+    for (int pos = 1500; pos < (int)sizeof(data); pos += 7000) {
+        int len = ((int)sizeof(data) - pos < 7000) ? (int)sizeof(data) - pos : 7000;
+        CHECK(len == wo_write(fd, data + pos, len));
+        CHECK(0 == wo_sync(fd));
+    }
+    CHECK(0 == wo_close(fd));
+    verify_file("reserved", data, sizeof(data));
+    verify_file("other", other, sizeof(other));
+
+    //reserving space for a clone gives it its own blocks and leaves the source alone
+    CHECK(0 == wo_clone("other", "other_copy"));
+    fd = wo_open("other_copy", WO_RDWR, 0);
+    CHECK(0 == wo_fallocate(fd, sizeof(data)));
+    CHECK(0 == wo_close(fd));
+    write_file("other_copy", data, 3000, 0);
+    remount();
+    verify_file("other", other, sizeof(other));
+    fd = wo_open("other_copy", WO_RDONLY, 0);
+    CHECK(sizeof(other) == wo_read(fd, read_buf, MAX_FILE_SIZE));
+    CHECK(0 == memcmp(read_buf, data, 3000) && 0 == memcmp(read_buf + 3000, other + 3000, sizeof(other) - 3000));
+    CHECK(0 == wo_close(fd));
+    verify_file("reserved", data, sizeof(data));
+    CHECK(0 == wo_unmount(NULL));
+}
+
+//a recorded workload replays with the recorded results, a truncated log replays up to the cut
+static void check_trace() {
+    static char data[30 * BLOCK_CHUNK_SIZE];
+    fill(data, sizeof(data), 800);
+    unlink(disk_name);
+    CHECK(0 == wo_trace_start(trace_name));
+    CHECK(0 == wo_mount(disk_name, NULL));
+    create_file("traced", data, sizeof(data));
+    CHECK(0 == wo_clone("traced", "traced_copy"));
+    write_file("traced_copy", data, 3000, 1);
+    int fd = wo_open("traced", WO_RDWR, 0);
+    CHECK(0 == wo_fallocate(fd, 2 * sizeof(data)));
+    CHECK(100 == wo_write(fd, data, 100));
+    CHECK(0 == wo_sync(fd));
+    CHECK(0 == wo_close(fd));
+    CHECK(-ENOENT == wo_open("missing", WO_RDONLY, 0));
+    CHECK(0 == wo_defrag(1000000));
+    CHECK(0 == wo_unmount(NULL));
+    CHECK(0 == wo_trace_stop());
+    int status = system("./replay check_trace.txt check_replay.txt > /dev/null");
+    CHECK(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    FILE *log = fopen(trace_name, "r+");
+    CHECK(NULL != log);
+    if (NULL != log) {
+        fseek(log, 0, SEEK_END);
+        CHECK(0 == ftruncate(fileno(log), ftell(log) - 5));
+        fclose(log);
+    }
+    status = system("./replay check_trace.txt check_replay.txt > /dev/null 2>&1");
+    CHECK(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    unlink(trace_name);
+    unlink("check_replay.txt");
+}
+
+//files on a striped disk survive a remount, which needs the recorded number of backing files
+static void check_striping() {
+    static char data[4][200 * BLOCK_CHUNK_SIZE];
+    int sizes[4] = {100, 5 * BLOCK_CHUNK_SIZE, 37 * BLOCK_CHUNK_SIZE + 11, sizeof(data[3])};
+    char *names[3] = {"check_stripe0.txt", "check_stripe1.txt", "check_stripe2.txt"};
+    char *files[4] = {"tiny", "unit", "odd", "large"};
+    for (int i = 0; i < 3; i++) {
+        unlink(names[i]);
+    }
+    CHECK(0 == wo_mount_striped(names, 3, 4, NULL));
+    for (int f = 0; f < 4; f++) {
+        fill(data[f], sizes[f], 300 + f);
+        create_file(files[f], data[f], sizes[f]);
+    }
+
+    //a second mount is refused without disturbing the mounted disk's layout
+    char *other[2] = {"check_other0.txt", "check_other1.txt"};
+    CHECK(-EEXIST == wo_mount_striped(other, 2, 64, NULL));
+    CHECK(-EEXIST == wo_mount(names[0], NULL));
+    CHECK(0 != access(other[0], F_OK));
+    for (int f = 0; f < 4; f++) {
+        verify_file(files[f], data[f], sizes[f]);
+    }
+    CHECK(0 == wo_unmount(NULL));
+    CHECK(-EINVAL == wo_mount_striped(names, 2, 4, NULL));
+    CHECK(-EINVAL == wo_mount(names[0], NULL));
+    CHECK(0 == wo_mount_striped(names, 3, 64, NULL));
+    for (int f = 0; f < 4; f++) {
+        verify_file(files[f], data[f], sizes[f]);
+    }
+    CHECK(0 == wo_unmount(NULL));
+    for (int i = 0; i < 3; i++) {
+        unlink(names[i]);
+    }
+}
+
+int main(){
+    int modes[3] = {WO_BUFFERED, WO_DIRECT, WO_DIRECT | WO_HUGE_PAGES};
+    char *names[3] = {"buffered", "direct", "direct, huge pages"};
+    for (int i = 0; i < 3; i++) {
+        pass_name = names[i];
+        CHECK(0 == wo_set_io_mode(modes[i]));
+        check_mount_errors();
+        check_remount();
+        check_defrag();
+        check_clone();
+        check_overwrite();
+        check_full_disk();
+        check_fallocate();
+        check_user_memory();
+        check_trace();
+        check_striping();
+    }
+    CHECK(0 == wo_set_io_mode(WO_BUFFERED));
+    unlink(disk_name);
+    if (failures) {
+        fprintf(stderr, "%d checks failed.\n", failures);
+        return 1;
+    }
+    printf("all checks passed.\n");
+    return 0;
+}
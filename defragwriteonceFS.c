@@ -0,0 +1,73 @@
+/**
+ * File: defragwriteonceFS.c
+ * Authors: Vikram Sahai Saxena(vs799), Vishwas Gowdihalli Mahalingappa(vg421)
+ * Defragment a writeonceFS disk in small time-bounded steps.
+ * Usage: ./defrag <disk file> [<disk file> ...] [-u <step budget in microseconds>]
+ * A disk striped across several backing files is named by all of them, in order.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_CHUNK_SIZE 1024
+#define MAX_STRIPES 8
+
+//stripe unit passed to wo_mount_striped(), an existing disk keeps the unit it was created with
+#define STRIPE_BLOCKS 64
+
+int check_disk(char *file_name, void *mem_address);
+int wo_mount_striped(char** file_names, int count, int unit, void* mem_address);
+int wo_unmount(void* mem_address);
+int wo_defrag(int max_usec);
+
+int main(int argc, char *argv[]){
+
+    char *disk_names[MAX_STRIPES];
+    int count = 0;
+    int step_usec = 1000;
+    for (int i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "-u") && i + 1 < argc) {
+            step_usec = atoi(argv[++i]);
+        } else if (MAX_STRIPES > count) {
+            disk_names[count++] = argv[i];
+        } else {
+            count = 0;
+            break;
+        }
+    }
+    if (0 == count) {
+        fprintf(stderr, "usage: %s <disk file> [<disk file> ...] [-u <step usec>]\n", argv[0]);
+        return 1;
+    }
+    char *disk_name = disk_names[0];
+
+    //never format: wo_mount() creates a new file system on anything that is not one
+    char super_block[BLOCK_CHUNK_SIZE];
+    if(check_disk(disk_name, super_block) < 0) {
+        fprintf(stderr, "%s is not a writeonceFS disk.\n", disk_name);
+        return 1;
+    }
+    int result = wo_mount_striped(disk_names, count, STRIPE_BLOCKS, NULL);
+    if(result < 0) {
+        fprintf(stderr, "wo_mount_striped()\t error: %s.\n", strerror(-result));
+        return 1;
+    }
+
+    int steps = 0;
+    int more;
+    while((more = wo_defrag(step_usec)) > 0) {
+        steps++;
+    }
+    if(more < 0) {
+        fprintf(stderr, "wo_defrag()\t error: %s.\n", strerror(-more));
+    } else {
+        printf("wo_defrag()\t done in %d steps.\n", steps + 1);
+    }
+
+    if(wo_unmount(NULL) < 0) {
+        fprintf(stderr, "wo_unmount()\t error.\n");
+        return 1;
+    }
+    return more < 0;
+}
@@ -0,0 +1,253 @@
+/**
+ * File: replaywriteonceFS.c
+ * Authors: Vikram Sahai Saxena(vs799), Vishwas Gowdihalli Mahalingappa(vg421)
+ * Replay a trace log recorded with wo_trace_start() against a fresh disk and report
+ * throughput, latency percentiles and the calls whose result differs from the recorded one.
+ * Usage: ./replay <trace log> <disk file> [-t]
+ *   -t : keep the original timing between calls instead of replaying at full speed
+ * A striped disk is replayed across <disk file>, <disk file>.1, <disk file>.2 and so on.
+ * Exits with 2 when a replayed result differs from the recorded one.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC 0x574F5452
+#define NO_OF_OPS 11
+#define MAX_TRACED_FDS 256
+#define MAX_STRIPES 8
+
+typedef enum {WO_CREAT = 1} mode;
+typedef enum {WO_RDONLY = 2, WO_WRONLY = 3, WO_RDWR = 4} flags;
+typedef enum {TRACE_MOUNT = 1, TRACE_UNMOUNT, TRACE_OPEN, TRACE_READ, TRACE_WRITE, TRACE_CLOSE, TRACE_SYNC, TRACE_FALLOCATE, TRACE_CLONE, TRACE_DEFRAG} trace_op;
+
+typedef struct {
+    int magic;
+    int record_size;
+} trace_header;
+
+typedef struct {
+    unsigned char op;
+    unsigned char name_len;
+    unsigned char fl;
+    unsigned char m;
+    int fd;
+    int bytes;
+    int result;
+    long long start_ns;
+    long long latency_ns;
+} trace_record;
+
+//latencies and result mismatches of one traced call
+typedef struct {
+    long long *replayed;
+    long long *recorded;
+    int count;
+    int cap;
+    int mismatches;
+} op_stats;
+
+int wo_mount(char* file_name, void* mem_address);
+int wo_mount_striped(char** file_names, int count, int unit, void* mem_address);
+int wo_unmount(void* mem_address);
+int wo_open(char* file_name, flags fl, mode m);
+int wo_read(int fd, void* buffer, int bytes);
+int wo_write(int fd, void* buffer, int bytes);
+int wo_close(int fd);
+int wo_sync(int fd);
+int wo_fallocate(int fd, int len);
+int wo_clone(char* src_name, char* dst_name);
+int wo_defrag(int max_usec);
+int wo_set_io_mode(int mode_flags);
+
+static char *op_names[NO_OF_OPS] = {"", "mount", "unmount", "open", "read", "write", "close", "sync", "fallocate", "clone", "defrag"};
+
+static long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(long long *values, int count, double p) {
+    int i = (int)(p * (count - 1) + 0.5);
+    return values[i] / 1000.0;
+}
+
+static void add_latency(op_stats *stats, long long replayed, long long recorded) {
+    if (stats->count == stats->cap) {
+        stats->cap = stats->cap ? stats->cap * 2 : 64;
+        stats->replayed = (long long*)realloc(stats->replayed, stats->cap * sizeof(long long));
+        stats->recorded = (long long*)realloc(stats->recorded, stats->cap * sizeof(long long));
+    }
+    stats->replayed[stats->count] = replayed;
+    stats->recorded[stats->count] = recorded;
+    stats->count++;
+}
+
+int main(int argc, char *argv[]){
+
+    if (3 > argc) {
+        fprintf(stderr, "usage: %s <trace log> <disk file> [-t]\n", argv[0]);
+        return 1;
+    }
+    char *disk_name = argv[2];
+    int timed = (3 < argc && 0 == strcmp("-t", argv[3]));
+
+    //read in the whole trace log
+    int f = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (0 > f || 0 > fstat(f, &st)) {
+        fprintf(stderr, "open()\t error: %s.\n", argv[1]);
+        return 1;
+    }
+    char *log = (char*)malloc(st.st_size);
+    if (NULL == log || st.st_size != read(f, log, st.st_size)) {
+        fprintf(stderr, "read()\t error: %s.\n", argv[1]);
+        return 1;
+    }
+    close(f);
+    trace_header *header = (trace_header*)log;
+    if ((long)sizeof(trace_header) > st.st_size || TRACE_MAGIC != header->magic || sizeof(trace_record) != header->record_size) {
+        fprintf(stderr, "%s is not a writeonceFS trace log.\n", argv[1]);
+        return 1;
+    }
+
+    //replay against a fresh disk
+    char stripe_names[MAX_STRIPES][PATH_MAX];
+    char *disk_names[MAX_STRIPES];
+    for (int i = 0; i < MAX_STRIPES; i++) {
+        if (0 == i) {
+            snprintf(stripe_names[i], PATH_MAX, "%s", disk_name);
+        } else {
+            snprintf(stripe_names[i], PATH_MAX, "%s.%d", disk_name, i);
+        }
+        disk_names[i] = stripe_names[i];
+        unlink(disk_names[i]);
+    }
+    int fd_map[MAX_TRACED_FDS];
+    for (int i = 0; i < MAX_TRACED_FDS; i++) {
+        fd_map[i] = -1;
+    }
+    op_stats stats[NO_OF_OPS];
+    memset(stats, 0, sizeof(stats));
+    char *data = NULL;
+    int data_cap = 0;
+    long long read_bytes = 0, write_bytes = 0;
+    int mounted = 0, calls = 0, mismatches = 0;
+    char name[258]; //file names separated by '\0', followed by two '\0'
+
+    long long replay_start = now_ns();
+    long pos = sizeof(trace_header);
+    while (pos < st.st_size) {
+        trace_record record;
+        if (pos + (long)sizeof(record) <= st.st_size) {
+            memcpy(&record, log + pos, sizeof(record));
+        }
+        if (pos + (long)sizeof(record) > st.st_size || pos + (long)sizeof(record) + record.name_len > st.st_size) {
+            fprintf(stderr, "%s is truncated, replay stops at byte %ld.\n", argv[1], pos);
+            break;
+        }
+        memcpy(name, log + pos + sizeof(record), record.name_len);
+        name[record.name_len] = name[record.name_len + 1] = '\0';
+        pos += sizeof(record) + record.name_len;
+        if (1 > record.op || NO_OF_OPS <= record.op) {
+            continue;
+        }
+
+        if (timed) {
+            long long wait = replay_start + record.start_ns - now_ns();
+            if (0 < wait) {
+                struct timespec delay = {wait / 1000000000LL, wait % 1000000000LL};
+                nanosleep(&delay, NULL);
+            }
+        }
+        int fd = (0 <= record.fd && MAX_TRACED_FDS > record.fd && 0 <= fd_map[record.fd]) ? fd_map[record.fd] : record.fd;
+        if ((TRACE_READ == record.op || TRACE_WRITE == record.op) && data_cap < record.bytes) {
+            data_cap = record.bytes;
+            data = (char*)realloc(data, data_cap);
+            for (int i = 0; i < data_cap; i++) {
+                data[i] = 'a' + i % 26;
+            }
+        }
+
+        long long start = now_ns();
+        int result = -1;
+        switch (record.op) {
+            case TRACE_MOUNT:
+                wo_set_io_mode(record.fl);
+                if (1 < record.m && MAX_STRIPES >= record.m) {
+                    result = wo_mount_striped(disk_names, record.m, record.bytes, NULL);
+                } else {
+                    result = wo_mount(disk_name, NULL);
+                }
+                mounted = (0 == result);
+                break;
+            case TRACE_UNMOUNT: result = wo_unmount(NULL); mounted = mounted && (0 != result); break;
+            case TRACE_OPEN: result = wo_open(name, record.fl, record.m); break;
+            case TRACE_READ: result = wo_read(fd, data, record.bytes); break;
+            case TRACE_WRITE: result = wo_write(fd, data, record.bytes); break;
+            case TRACE_CLOSE: result = wo_close(fd); break;
+            case TRACE_SYNC: result = wo_sync(fd); break;
+            case TRACE_FALLOCATE: result = wo_fallocate(fd, record.bytes); break;
+            case TRACE_CLONE: result = wo_clone(name, name + strlen(name) + 1); break;
+            case TRACE_DEFRAG: result = wo_defrag(record.bytes); break;
+        }
+        add_latency(&stats[record.op], now_ns() - start, record.latency_ns);
+        calls++;
+
+        //descriptors may be numbered differently, so opens only have to agree on success
+        if ((TRACE_OPEN == record.op) ? ((0 <= result) != (0 <= record.result)) : (result != record.result)) {
+            stats[record.op].mismatches++;
+            mismatches++;
+        }
+
+        if (TRACE_OPEN == record.op && 0 <= record.result && MAX_TRACED_FDS > record.result) {
+            fd_map[record.result] = result;
+        } else if (TRACE_READ == record.op && 0 < result) {
+            read_bytes += result;
+        } else if (TRACE_WRITE == record.op && 0 < result) {
+            write_bytes += result;
+        }
+    }
+    double elapsed = (now_ns() - replay_start) / 1e9;
+    if (mounted) {
+        wo_unmount(NULL);
+    }
+
+    //report throughput and latency percentiles in microseconds
+    printf("replayed %d calls in %.3f s (%s): %.0f calls/s, read %.2f MB/s, write %.2f MB/s\n",
+        calls, elapsed, timed ? "original timing" : "full speed", calls / elapsed,
+        read_bytes / elapsed / (1024 * 1024), write_bytes / elapsed / (1024 * 1024));
+    printf("%d of %d calls returned a different result than recorded.\n", mismatches, calls);
+    printf("%-9s %8s %10s %10s %10s %10s %12s %9s\n", "call", "count", "p50 us", "p90 us", "p99 us", "max us", "rec p50 us", "mismatch");
+    for (int op = 1; op < NO_OF_OPS; op++) {
+        op_stats *s = &stats[op];
+        if (0 == s->count) {
+            continue;
+        }
+        qsort(s->replayed, s->count, sizeof(long long), compare_ll);
+        qsort(s->recorded, s->count, sizeof(long long), compare_ll);
+        printf("%-9s %8d %10.1f %10.1f %10.1f %10.1f %12.1f %9d\n", op_names[op], s->count,
+            percentile(s->replayed, s->count, 0.5), percentile(s->replayed, s->count, 0.9),
+            percentile(s->replayed, s->count, 0.99), s->replayed[s->count - 1] / 1000.0,
+            percentile(s->recorded, s->count, 0.5), s->mismatches);
+        free(s->replayed);
+        free(s->recorded);
+    }
+    free(data);
+    free(log);
+    return (0 < mismatches) ? 2 : 0;
+}
@@ -3,13 +3,21 @@
  * Authors: Vikram Sahai Saxena(vs799), Vishwas Gowdihalli Mahalingappa(vg421)
  * iLab machine tested on: -ilab1.cs.rutgers.edu
  */
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 
 //File System Size = 4MB
 #define FILE_SYSTEM_SIZE 4*1024*1024
@@ -29,35 +37,173 @@
 //Maximum Number of File Descriptors
 #define MAX_FILE_DESCRIPTORS 15
 
+//Number of blocks holding the inode table (must fit NO_OF_FILES inodes)
+#define NO_OF_INODE_BLOCKS 3
 
-static int disk_handle; //disk handle for a creaqted disk
+//Number of blocks tracked by the block map (2 map blocks, 1 byte per block)
+#define NO_OF_MAP_ENTRIES (2*BLOCK_CHUNK_SIZE)
+
+//First block available for file data (super block, inode blocks, 2 map blocks)
+#define FIRST_DATA_BLOCK (1 + NO_OF_INODE_BLOCKS + 2)
+
+//Maximum bytes held in delayed allocation buffers before they are flushed
+#define MAX_BUFFERED_BYTES (512*1024)
+
+//Magic number identifying a formatted disk ("WOFS")
+#define FILE_SYSTEM_MAGIC 0x574F4653
+
+//Size of the preallocated block buffer arena (one 2MB huge page) serving all block I/O buffers,
+//delayed allocation buffers are bounded separately by MAX_BUFFERED_BYTES
+#define ARENA_SIZE (2*1024*1024)
+
+//Number of blocks in one arena buffer
+#define ARENA_SLOT_BLOCKS 64
+
+//Maximum number of blocks moved by a single defragmentation step (one arena buffer)
+#define DEFRAG_STEP_BLOCKS ARENA_SLOT_BLOCKS
+
+//Size of the in-memory trace record buffer
+#define TRACE_BUFFER_SIZE (64*1024)
+
+//Magic number identifying a trace log ("WOTR")
+#define TRACE_MAGIC 0x574F5452
+
+//Maximum number of backing files a disk can be striped across
+#define MAX_STRIPES 8
+
+//Default stripe unit in blocks
+#define STRIPE_BLOCKS 64
+
+//Minimum request size in blocks dispatched to the backing files in parallel
+#define STRIPE_PARALLEL_BLOCKS 16
+
+//Maximum number of buffer segments of one striped run, a run of count blocks spans at most
+//count / stripe_blocks + 2 stripe units, dealt round-robin to at most MAX_STRIPES backing files
+#define MAX_STRIPE_SEGMENTS (NO_OF_DISK_BLOCKS + MAX_STRIPES + 2)
+
+
+static int disk_handles[MAX_STRIPES]; //disk handles, one per backing file
+static int stripe_count = 1; //number of backing files the disk is striped across
+static int stripe_blocks = STRIPE_BLOCKS; //stripe unit in blocks
 static int disk_open = 0; //flag to indicate if disk is open: 0 = closed, 1 = open
+static int io_flags = 0; //I/O mode flags applied on the next mount
+static int direct_io = 0; //flag to indicate if the disk is open with O_DIRECT
+static char *arena_ptr = NULL; //preallocated block buffer arena
+static char *arena_free = NULL; //free list of arena buffers
+static int arena_huge = 0; //flag to indicate if the arena is backed by huge pages
+static int trace_handle = -1; //trace log handle, -1 when tracing is off
+static char *trace_buffer = NULL; //trace records not yet written to the log
+static int trace_len = 0; //bytes held in the trace buffer
+static long long trace_epoch = 0; //trace start time in nanoseconds
+static int defrag_file = -1; //file being moved into the free tail by defragmentation, -1 if none
+static int defrag_dest = 0; //first block of the moved file's new run
+static int defrag_count = 0; //number of blocks of the moved file
+static int defrag_moved = 0; //blocks already moved, taken from the end of the file
 
 //helper method declarations
-int ready_disk(char *file_name);
-int open_disk(char *file_name);
+int ready_disk(char *file_name, int blocks);
+int open_disk(char **file_names, int count);
 int close_disk();
+int direct_aligned(int handle);
 int read_block(int block_index, char *buffer);
 int write_block(int block_index, char *buffer);
-int disk_init(char *file_name, void *mem_address);
+int read_blocks(int block_index, int count, char *buffer);
+int write_blocks(int block_index, int count, char *buffer);
+int bounce_blocks(int block_index, int count, char *buffer, int (*block_io)(int, int, char *));
+int stripe_io(int block_index, int count, char *buffer, int write_flag);
+void *stripe_worker(void *queue);
+void stripe_start();
+void stripe_stop();
+int arena_init(int huge_pages);
+void arena_release();
+char *arena_get();
+void arena_put(char *buffer);
+int disk_init(char **file_names, int count, int unit, void *mem_address);
+int load_disk(char **file_names, int count, int unit, void *mem_address);
+int save_disk(void *mem_address);
+void unload_disk();
+int check_disk(char *file_name, void *mem_address);
 char search_file(char* name);
 int available_file_des(char file_index);
 int search_next_block(int current, char file_index);
-int search_available_block(char file_index);
+int search_available_run(int start, int count);
+int free_blocks();
+int pending_blocks(char file_index, int size);
+char block_owner(char file_index);
+int file_block(char file_index, int block_no);
+int file_blocks_io(char file_index, int first, int count, char *buffer, int (*block_io)(int, int, char *));
+int buffer_file(char file_index, int start, int end);
+int flush_file(char file_index);
+void drop_buffer(char file_index);
+int largest_buffer();
+int defrag_step();
+int defrag_move();
 int wo_create(char *file_name);
+int fs_mount(char* file_name, void* mem_address);
+int fs_mount_striped(char** file_names, int count, int unit, void* mem_address);
+int fs_unmount(void* mem_address);
+int fs_read(int fd, void* buffer, int bytes);
+int fs_write(int fd, void* buffer, int bytes);
+int fs_close(int fd);
+int fs_sync(int fd);
+int fs_fallocate(int fd, int len);
+int fs_clone(char* src_name, char* dst_name);
+int fs_defrag(int max_usec);
+long long trace_clock();
+void trace_call(int op, long long start, int fd, int bytes, int result, char **names, int count, int fl, int m);
+int trace_flush();
+void trace_exit();
 
 //enum declarations
 typedef enum {NO, YES} in_use;
 typedef enum {WO_CREAT = 1} mode;
 typedef enum {WO_RDONLY = 2, WO_WRONLY = 3, WO_RDWR = 4} flags;
+typedef enum {WO_BUFFERED = 0, WO_DIRECT = 1, WO_HUGE_PAGES = 2} io_mode;
+typedef enum {TRACE_MOUNT = 1, TRACE_UNMOUNT, TRACE_OPEN, TRACE_READ, TRACE_WRITE, TRACE_CLOSE, TRACE_SYNC, TRACE_FALLOCATE, TRACE_CLONE, TRACE_DEFRAG} trace_op;
+
+int fs_open(char* file_name, flags fl, mode m);
 
 //super block structure
 typedef struct {
     int inode_block_index; //inode block index
     int inode_block_size; //inode block size
     int data_block_index; //data block index
+    int fs_magic; //magic number identifying a formatted disk
+    int stripe_count; //number of backing files the disk is striped across
+    int stripe_blocks; //stripe unit in blocks
 } super_block;
 
+//striped I/O request for one backing file
+typedef struct stripe_request {
+    int handle; //backing file handle
+    int write_flag; //1 to write, 0 to read
+    off_t offset; //backing file offset of the first segment
+    struct iovec *iov; //buffer segments, consecutive in the backing file
+    int iov_count; //number of buffer segments
+    int result; //0 on success, -1 on error
+    int finished; //flag set by the worker once the request is served
+    struct stripe_request *next; //next request in the worker queue
+} stripe_request;
+
+//request queue of the persistent I/O worker of one backing file
+typedef struct {
+    pthread_t thread; //worker thread
+    pthread_mutex_t lock; //protects the queue and the finished flags of its requests
+    pthread_cond_t wake; //signalled when a request is queued or the worker should stop
+    pthread_cond_t done; //signalled when a request is served
+    stripe_request *head; //first queued request
+    stripe_request *tail; //last queued request
+    int stop; //flag to ask the worker to exit
+    int running; //flag to indicate the worker thread is running
+} stripe_queue;
+
+static stripe_queue stripe_queues[MAX_STRIPES]; //one worker per backing file of a striped disk
+static struct iovec stripe_iov[MAX_STRIPE_SEGMENTS]; //buffer segments of the striped run in flight
+
+void stripe_serve(stripe_request *req);
+void stripe_submit(stripe_queue *queue, stripe_request *req);
+void stripe_wait(stripe_queue *queue, stripe_request *req);
+
 //inode structure
 typedef struct {
     char fname[MAX_FILENAME_LEN]; //file name
@@ -65,8 +211,13 @@ typedef struct {
     int fhead; //first data block position for file
     int fblock_count; //number of file blocks
     in_use file_in_use; //flag to indicate file usage
+    int fshare; //index of the file owning the shared data blocks, -1 if not a clone
+    int fref; //number of clones sharing this file's data blocks
+    int freserved; //blocks owned past the file data, reserved by wo_fallocate
 } inode;
 
+_Static_assert(NO_OF_FILES * sizeof(inode) <= NO_OF_INODE_BLOCKS * BLOCK_CHUNK_SIZE, "inode table does not fit NO_OF_INODE_BLOCKS");
+
 //file descriptor structure
 typedef struct {
     char findex; //file index
@@ -74,52 +225,425 @@ typedef struct {
     in_use fd_in_use; //flag to indicate file descriptor usage
 } file_des;
 
+//delayed allocation buffer structure
+typedef struct {
+    char *data; //buffered file bytes
+    int base; //file offset of the first buffered byte (block aligned)
+    int len; //number of buffered bytes
+    int cap; //allocated buffer capacity
+    int reserve; //blocks the file should own after the next flush, set by wo_fallocate
+} file_buf;
+
 file_des file_des_table[MAX_FILE_DESCRIPTORS]; //Table of file descriptors
+file_buf file_buf_table[NO_OF_FILES]; //Table of delayed allocation buffers
 super_block *sb_ptr; //super block pointer
 inode *inode_ptr; //inode pointer
+char *map_ptr; //block map pointer, one owner byte (file index + 1) per block
+int buffered_bytes = 0; //bytes held in delayed allocation buffers
+
+//trace log header structure
+typedef struct {
+    int magic; //magic number identifying a trace log
+    int record_size; //size of one trace record
+} trace_header;
+
+//trace record structure, followed by name_len bytes of file name
+typedef struct {
+    unsigned char op; //traced call
+    unsigned char name_len; //length of the file name following the record
+    unsigned char fl; //open flags
+    unsigned char m; //open mode
+    int fd; //file descriptor argument
+    int bytes; //size argument
+    int result; //return value
+    long long start_ns; //call start relative to the trace start
+    long long latency_ns; //call duration
+} trace_record;
+
+/**
+ * wo_trace_start() : start recording every mount/unmount/open/read/write/close/sync/fallocate/clone/defrag
+ * call to a binary log. The I/O mode set with wo_set_io_mode() is recorded with each mount.
+ * The log is completed at wo_trace_stop() or at process exit, whichever comes first.
+ * 
+ * @param log_name : trace log file name
+ * @return int : 0 on success, any negative number on error
+ */
+int wo_trace_start(char *log_name) {
+    static int exit_flush = 0;
+    if (0 <= trace_handle) {
+        errno = EBUSY;
+        return -errno;
+    }
+    if (NULL == (trace_buffer = (char*)malloc(TRACE_BUFFER_SIZE))) {
+        errno = ENOMEM;
+        return -errno;
+    }
+    if (0 > (trace_handle = open(log_name, O_WRONLY | O_CREAT | O_TRUNC, 0644))) {
+        free(trace_buffer);
+        trace_buffer = NULL;
+        errno = EACCES;
+        return -errno;
+    }
+    if (!exit_flush) {
+        exit_flush = (0 == atexit(trace_exit));
+    }
+
+    //write the header right away so even an empty log can be replayed
+    trace_header header = {TRACE_MAGIC, sizeof(trace_record)};
+    memcpy(trace_buffer, &header, sizeof(header));
+    trace_len = sizeof(header);
+    trace_epoch = trace_clock();
+    return trace_flush();
+}
+
+/**
+ * wo_trace_stop() : write out the remaining trace records and close the trace log
+ * 
+ * @return int : 0 on success, any negative number on error
+ */
+int wo_trace_stop() {
+    if (0 > trace_handle) {
+        errno = ENOENT;
+        return -errno;
+    }
+    int result = trace_flush();
+    close(trace_handle);
+    free(trace_buffer);
+    trace_handle = -1;
+    trace_buffer = NULL;
+    return result;
+}
+
+//The wo_* calls below run their fs_* implementation and append a trace record when tracing is on.
 
 /**
- * wo_mount() : Attempt to read in an entire 'diskfile'.
+ * wo_mount() : Attempt to read in an entire 'diskfile'. Tracing starts here when WO_TRACE names a trace log.
  * 
  * @param file_name : File name holding the entire disk
  * @param mem_address : address to read the entire 'disk' in to
  * @return int : 0 on success, any negative number on error
  */
 int wo_mount(char* file_name, void* mem_address) {
-    //check for proper filename
-    if (NULL == file_name) {
+    if (0 > trace_handle && NULL != getenv("WO_TRACE")) {
+        wo_trace_start(getenv("WO_TRACE"));
+    }
+    if (0 > trace_handle) {
+        return fs_mount(file_name, mem_address);
+    }
+    long long start = trace_clock();
+    int result = fs_mount(file_name, mem_address);
+    trace_call(TRACE_MOUNT, start, -1, 0, result, &file_name, 1, io_flags, 0);
+    return result;
+}
+
+/**
+ * wo_mount_striped() : Attempt to read in a 'diskfile' striped RAID-0 style across several backing files.
+ * 
+ * @param file_names : backing file names, the first one holds the super block
+ * @param count : number of backing files
+ * @param unit : stripe unit in blocks used when the disk is created
+ * @param mem_address : address to read the entire 'disk' in to
+ * @return int : 0 on success, any negative number on error
+ */
+int wo_mount_striped(char** file_names, int count, int unit, void* mem_address) {
+    if (0 > trace_handle && NULL != getenv("WO_TRACE")) {
+        wo_trace_start(getenv("WO_TRACE"));
+    }
+    if (0 > trace_handle) {
+        return fs_mount_striped(file_names, count, unit, mem_address);
+    }
+    long long start = trace_clock();
+    int result = fs_mount_striped(file_names, count, unit, mem_address);
+    int names = (NULL == file_names || 0 >= count || MAX_STRIPES < count) ? 0 : count;
+    trace_call(TRACE_MOUNT, start, -1, unit, result, file_names, names, io_flags, count);
+    return result;
+}
+
+/**
+ * wo_unmount() : Attempt to write out an entire 'diskfile'. Trace records are written out to the log here.
+ * 
+ * @param mem_address : disk address
+ * @return int : 0 on success, any negative number on error
+ */
+int wo_unmount(void* mem_address) {
+    if (0 > trace_handle) {
+        return fs_unmount(mem_address);
+    }
+    long long start = trace_clock();
+    int result = fs_unmount(mem_address);
+    trace_call(TRACE_UNMOUNT, start, -1, 0, result, NULL, 0, 0, 0);
+    trace_flush();
+    return result;
+}
+
+/**
+ * wo_open() : Attempt to open/create file
+ * 
+ * @param file_name : file name that is opened/created in the File System
+ * @param fl : file permission flag
+ * @param m : mode flag for file creation
+ * @return int : file descriptor on success, any negative number on error
+ */
+int wo_open(char* file_name, flags fl, mode m) {
+    if (0 > trace_handle) {
+        return fs_open(file_name, fl, m);
+    }
+    long long start = trace_clock();
+    int result = fs_open(file_name, fl, m);
+    trace_call(TRACE_OPEN, start, -1, 0, result, &file_name, 1, fl, m);
+    return result;
+}
+
+/**
+ * wo_read() : read file bytes to buffer
+ * 
+ * @param fd : file descriptor
+ * @param buffer : memory location to read bytes in to
+ * @param bytes : number of bytes to read
+ * @return int : bytes read on success, any negative number on error
+ */
+int wo_read(int fd,  void* buffer, int bytes) {
+    if (0 > trace_handle) {
+        return fs_read(fd, buffer, bytes);
+    }
+    long long start = trace_clock();
+    int result = fs_read(fd, buffer, bytes);
+    trace_call(TRACE_READ, start, fd, bytes, result, NULL, 0, 0, 0);
+    return result;
+}
+
+/**
+ * wo_write() : write bytes from buffer to file
+ * 
+ * @param fd : file descriptor
+ * @param buffer : memory location to write bytes from
+ * @param bytes : number of bytes to write
+ * @return int : bytes written on success, any negative number on error
+ */
+int wo_write(int fd,  void* buffer, int bytes) {
+    if (0 > trace_handle) {
+        return fs_write(fd, buffer, bytes);
+    }
+    long long start = trace_clock();
+    int result = fs_write(fd, buffer, bytes);
+    trace_call(TRACE_WRITE, start, fd, bytes, result, NULL, 0, 0, 0);
+    return result;
+}
+
+/**
+ * wo_close() : close file in the File System.
+ * 
+ * @param fd : file descriptor
+ * @return int : 0 on success, any negative number on error
+ */
+int wo_close(int fd) {
+    if (0 > trace_handle) {
+        return fs_close(fd);
+    }
+    long long start = trace_clock();
+    int result = fs_close(fd);
+    trace_call(TRACE_CLOSE, start, fd, 0, result, NULL, 0, 0, 0);
+    return result;
+}
+
+/**
+ * wo_sync() : allocate blocks for and write out all buffered data of a file
+ * 
+ * @param fd : file descriptor
+ * @return int : 0 on success, any negative number on error
+ */
+int wo_sync(int fd) {
+    if (0 > trace_handle) {
+        return fs_sync(fd);
+    }
+    long long start = trace_clock();
+    int result = fs_sync(fd);
+    trace_call(TRACE_SYNC, start, fd, 0, result, NULL, 0, 0, 0);
+    return result;
+}
+
+/**
+ * wo_fallocate() : reserve blocks for a file to grow to len bytes without changing its size
+ * 
+ * @param fd : file descriptor
+ * @param len : file length in bytes to reserve blocks for
+ * @return int : 0 on success, any negative number on error
+ */
+int wo_fallocate(int fd, int len) {
+    if (0 > trace_handle) {
+        return fs_fallocate(fd, len);
+    }
+    long long start = trace_clock();
+    int result = fs_fallocate(fd, len);
+    trace_call(TRACE_FALLOCATE, start, fd, len, result, NULL, 0, 0, 0);
+    return result;
+}
+
+/**
+ * wo_clone() : create a copy of a file sharing the source's data blocks
+ * 
+ * @param src_name : file name to copy
+ * @param dst_name : file name of the copy
+ * @return int : 0 on success, any negative number on error
+ */
+int wo_clone(char* src_name, char* dst_name) {
+    if (0 > trace_handle) {
+        return fs_clone(src_name, dst_name);
+    }
+    long long start = trace_clock();
+    int result = fs_clone(src_name, dst_name);
+    char *names[2] = {src_name, dst_name};
+    trace_call(TRACE_CLONE, start, -1, 0, result, names, 2, 0, 0);
+    return result;
+}
+
+/**
+ * wo_defrag() : defragment the mounted File System in small steps, call repeatedly until it returns 0
+ * 
+ * @param max_usec : time budget for this call in microseconds
+ * @return int : 1 if more work remains, 0 when defragmented, any negative number on error
+ */
+int wo_defrag(int max_usec) {
+    if (0 > trace_handle) {
+        return fs_defrag(max_usec);
+    }
+    long long start = trace_clock();
+    int result = fs_defrag(max_usec);
+    trace_call(TRACE_DEFRAG, start, -1, max_usec, result, NULL, 0, 0, 0);
+    return result;
+}
+
+/**
+ * wo_set_io_mode() : select how the next mounted disk is accessed.
+ * WO_DIRECT bypasses the kernel page cache with O_DIRECT (falling back to buffered I/O where
+ * unsupported), WO_HUGE_PAGES backs the block buffer arena with a huge page when available.
+ * 
+ * @param mode_flags : WO_BUFFERED or a combination of WO_DIRECT and WO_HUGE_PAGES
+ * @return int : 0 on success, any negative number on error
+ */
+int wo_set_io_mode(int mode_flags) {
+    if (disk_open) {
+        errno = EBUSY;
+        return -errno;
+    }
+    io_flags = mode_flags;
+    return 0;
+}
+
+/**
+ * fs_mount() : Attempt to read in an entire 'diskfile'.
+ * 
+ * @param file_name : File name holding the entire disk
+ * @param mem_address : address to read the entire 'disk' in to
+ * @return int : 0 on success, any negative number on error
+ */
+int fs_mount(char* file_name, void* mem_address) {
+    return fs_mount_striped(&file_name, 1, STRIPE_BLOCKS, mem_address);
+}
+
+/**
+ * fs_mount_striped() : Attempt to read in a 'diskfile' striped RAID-0 style across several backing files.
+ * An existing disk is mounted with the layout recorded in its super block.
+ * 
+ * @param file_names : backing file names, the first one holds the super block
+ * @param count : number of backing files
+ * @param unit : stripe unit in blocks used when the disk is created
+ * @param mem_address : address to read the entire 'disk' in to
+ * @return int : 0 on success, any negative number on error
+ */
+int fs_mount_striped(char** file_names, int count, int unit, void* mem_address) {
+    //check for proper filenames and layout
+    if (NULL == file_names || 0 >= count || MAX_STRIPES < count || 0 >= unit) {
         return -1;
     }
-    if (NULL == mem_address) {
-        mem_address = (char*)malloc(FILE_SYSTEM_SIZE);
+    for (int i = 0; i < count; i++) {
+        if (NULL == file_names[i]) {
+            return -1;
+        }
+    }
+
+    //refuse a second mount before anything is read, formatted or laid out for the new disk
+    if (disk_open) {
+        errno = EEXIST;
+        return -errno;
+    }
+    if (0 > arena_init(io_flags & WO_HUGE_PAGES)) {
+        errno = ENOMEM;
+        return -errno;
+    }
+    char *arena_mem = NULL;
+    if (NULL == mem_address && NULL == (mem_address = arena_mem = arena_get())) {
+        errno = ENOMEM;
+        return -errno;
+    }
+    int result = load_disk(file_names, count, unit, mem_address);
+    if (NULL != arena_mem) {
+        arena_put(arena_mem);
     }
+    return result;
+}
 
-    //build initial structures for accessing the disk.
-    if (disk_init(file_name, mem_address)) {
+/**
+ * load_disk() : format the disk if needed, then open it and read in the super block, inode table and block map.
+ * Nothing is left open or allocated on error.
+ * 
+ * @param file_names : backing file names, the first one holds the super block
+ * @param count : number of backing files
+ * @param unit : stripe unit in blocks used when the disk is created
+ * @param mem_address : buffer of at least NO_OF_INODE_BLOCKS blocks
+ * @return int : 0 on success, any negative number on error
+ */
+int load_disk(char** file_names, int count, int unit, void* mem_address) {
+    //build initial structures for accessing the disk unless it is already formatted.
+    if (0 == check_disk(file_names[0], mem_address)) {
+        super_block disk_sb;
+        memcpy(&disk_sb, mem_address, sizeof(super_block));
+        if (count != ((0 < disk_sb.stripe_count) ? disk_sb.stripe_count : 1)
+                || 1 != disk_sb.inode_block_index || 1 + NO_OF_INODE_BLOCKS != disk_sb.data_block_index) {
+            errno = EINVAL;
+            return -errno;
+        }
+        stripe_blocks = (0 < disk_sb.stripe_blocks) ? disk_sb.stripe_blocks : STRIPE_BLOCKS;
+    } else if (disk_init(file_names, count, unit, mem_address)) {
         errno = EACCES;
         return -errno;
     }
-    if (open_disk(file_name)) {
-        errno = (EEXIST == open_disk(file_name)) ? EEXIST: EACCES;
+    if (open_disk(file_names, count)) {
+        errno = (EEXIST == open_disk(file_names, count)) ? EEXIST: EACCES;
         return -errno;
     }
     
+    sb_ptr = (super_block*)malloc(sizeof(super_block));
+    inode_ptr = (inode*)calloc(NO_OF_FILES, sizeof(inode));
+    map_ptr = (char*)aligned_alloc(BLOCK_CHUNK_SIZE, NO_OF_MAP_ENTRIES);
+    if (NULL == sb_ptr || NULL == inode_ptr || NULL == map_ptr) {
+        unload_disk();
+        errno = ENOMEM;
+        return -errno;
+    }
+
     //read the super block
-    memset(mem_address, 0, BLOCK_CHUNK_SIZE);
     if (0 > read_block(0, mem_address)) {
+        unload_disk();
         errno = EACCES;
         return -errno;
     }
-    memcpy(&sb_ptr, mem_address, sizeof(sb_ptr));
+    memcpy(sb_ptr, mem_address, sizeof(super_block));
 
-    //read the inode block
-    memset(mem_address, 0, BLOCK_CHUNK_SIZE);
-    if (0 > read_block(sb_ptr->inode_block_index, mem_address)) {
+    //read the inode table
+    if (0 > read_blocks(sb_ptr->inode_block_index, NO_OF_INODE_BLOCKS, mem_address)) {
+        unload_disk();
+        errno = EACCES;
+        return -errno;
+    }
+    memcpy(inode_ptr, mem_address, sizeof(inode)*NO_OF_FILES);
+
+    //read the block map
+    if (0 > read_blocks(sb_ptr->data_block_index, NO_OF_MAP_ENTRIES / BLOCK_CHUNK_SIZE, map_ptr)) {
+        unload_disk();
         errno = EACCES;
         return -errno;
     }
-    inode_ptr = (inode*)malloc(BLOCK_CHUNK_SIZE);
-    memcpy(inode_ptr, mem_address, sizeof(inode)*(sb_ptr->inode_block_size));
 
     //reset all file descriptors in file descriptor table to not in use
     int i = 0;
@@ -127,34 +651,70 @@ int wo_mount(char* file_name, void* mem_address) {
         file_des_table[i].fd_in_use = NO;
         i++;
     }
+
+    //reset all delayed allocation buffers
+    memset(file_buf_table, 0, sizeof(file_buf_table));
+    buffered_bytes = 0;
+    defrag_file = -1;
     return 0;
 }
 
 /**
- * wo_unmount() : Attempt to write out an entire 'diskfile'.
+ * fs_unmount() : Attempt to write out an entire 'diskfile'.
  * 
  * @param mem_address : disk address
  * @return int : 0 on success, any negative number on error
  */
-int wo_unmount(void* mem_address) {
-    if (NULL == mem_address) {
-        mem_address = (char*)malloc(FILE_SYSTEM_SIZE);
+int fs_unmount(void* mem_address) {
+    if (!disk_open) {
+        errno = ENOENT;
+        return -errno;
     }
+    char *arena_mem = NULL;
+    if (NULL == mem_address && NULL == (mem_address = arena_mem = arena_get())) {
+        errno = ENOMEM;
+        return -errno;
+    }
+    int result = save_disk(mem_address);
+    if (NULL != arena_mem) {
+        arena_put(arena_mem);
+    }
+    arena_release();
+    return result;
+}
 
-    //write out the disk contents
-    memset(mem_address, 0, BLOCK_CHUNK_SIZE);
-    char* block_ptr = (char*)mem_address;
+/**
+ * save_disk() : write out all buffered file data, the inode table and the super block, then close the disk.
+ * The disk is closed even on error.
+ * 
+ * @param mem_address : buffer of at least NO_OF_INODE_BLOCKS blocks
+ * @return int : 0 on success, any negative number on error
+ */
+int save_disk(void* mem_address) {
+    //allocate and write out all buffered file data, a file that cannot be written out loses its
+    //buffered data but the rest of the disk is still saved
+    int result = 0;
     int i = 0;
     while (NO_OF_FILES > i) {
-        if (YES == inode_ptr[i].file_in_use) {
-            memcpy(block_ptr, &inode_ptr[i], sizeof(inode_ptr[i]));
-            block_ptr += sizeof(inode);
+        if (0 > flush_file(i)) {
+            result = (0 == result) ? -errno : result;
+            drop_buffer(i);
         }
         i++;
     }
-    if (0 > write_block(sb_ptr->inode_block_index, mem_address)) {
-        errno = EACCES;
-        return -errno;
+
+    //write out the inode table, inodes keep their index since the block map refers to them by it
+    memset(mem_address, 0, NO_OF_INODE_BLOCKS * BLOCK_CHUNK_SIZE);
+    memcpy(mem_address, inode_ptr, sizeof(inode)*NO_OF_FILES);
+    if (0 > write_blocks(sb_ptr->inode_block_index, NO_OF_INODE_BLOCKS, mem_address)) {
+        result = (0 == result) ? -EACCES : result;
+    }
+
+    //write out the super block
+    memset(mem_address, 0, BLOCK_CHUNK_SIZE);
+    memcpy(mem_address, sb_ptr, sizeof(super_block));
+    if (0 > write_block(0, mem_address)) {
+        result = (0 == result) ? -EACCES : result;
     }
     //reset file descriptors
     i = 0;
@@ -166,21 +726,33 @@ int wo_unmount(void* mem_address) {
         }
         i++;
     }
+    unload_disk();
+    errno = -result;
+    return result;
+}
+
+/**
+ * unload_disk() : free the in-memory super block, inode table and block map and close the disk
+ */
+void unload_disk() {
+    free(sb_ptr);
     free(inode_ptr);
-    free(mem_address);
+    free(map_ptr);
+    sb_ptr = NULL;
+    inode_ptr = NULL;
+    map_ptr = NULL;
     close_disk();
-    return 0;
 }
 
 /**
- * wo_open() : Attempt to open/create file
+ * fs_open() : Attempt to open/create file
  * 
  * @param file_name : file name that is opened/created in the File System
  * @param fl : file permission flag
  * @param m : mode flag for file creation
  * @return int : 0 on success, any negative number on error
  */
-int wo_open(char* file_name, flags fl, mode m) { 
+int fs_open(char* file_name, flags fl, mode m) { 
     if (WO_CREAT != m) {//mode is not set to WO_CREAT
         char f_index = search_file(file_name);
         if (0 <= f_index) {
@@ -206,7 +778,10 @@ int wo_open(char* file_name, flags fl, mode m) {
             errno = EEXIST;
             return -errno;
         } else {
-            wo_create(file_name);
+            if (0 > wo_create(file_name)) {//inode table is full
+                errno = ENOSPC;
+                return -errno;
+            }
             char file_index = search_file(file_name);
             int fd = available_file_des(file_index);
             if (0 > fd) {
@@ -218,14 +793,14 @@ int wo_open(char* file_name, flags fl, mode m) {
 }
 
 /**
- * wo_read():  read file bytes to buffer
+ * fs_read():  read file bytes to buffer
  * 
  * @param fd : file descriptor
  * @param buffer : memory location to read bytes in to
  * @param bytes : number of bytes to read
  * @return int : bytes read on success, any negative number on error
  */
-int wo_read(int fd,  void* buffer, int bytes) {
+int fs_read(int fd,  void* buffer, int bytes) {
     //check for valid file descriptor
     if(0 >= bytes || !file_des_table[fd].fd_in_use) {
         errno = ENOENT;
@@ -233,47 +808,50 @@ int wo_read(int fd,  void* buffer, int bytes) {
     }
     char f_index = file_des_table[fd].findex;
     inode* file_ptr = &inode_ptr[f_index];
-    char block[BLOCK_CHUNK_SIZE] = "";
+    file_buf* buf_ptr = &file_buf_table[f_index];
+    char *block = NULL;
     int offset = file_des_table[fd].offset;
-    int b_index = file_ptr->fhead;
-    int blocks = 0;
 
-    //read current block
-    while (BLOCK_CHUNK_SIZE <= offset) {
-        b_index = search_next_block(b_index, f_index);
-        offset -= BLOCK_CHUNK_SIZE;
-        blocks++;
+    //never read past the end of the file
+    if (file_ptr->fsize - offset < bytes) {
+        bytes = file_ptr->fsize - offset;
     }
-    read_block(b_index, block);
     char *buffer_ptr = buffer;
     int read_bytes = 0;
-    int i = offset;
-    while (BLOCK_CHUNK_SIZE > i) {
-        buffer_ptr[read_bytes++] = block[i];
-        if (bytes == read_bytes) {
-            file_des_table[fd].offset += read_bytes;
-            return read_bytes;
-        }
-        i++;
-    }
-    strcpy(block,"");
-    blocks++;
-
-    //read next blocks
-    while (bytes > read_bytes && (file_ptr->fblock_count) >= blocks) {
-        b_index = search_next_block(b_index, f_index);
-        strcpy(block,"");
-        read_block(b_index, block);
-        i = 0;
-        while (BLOCK_CHUNK_SIZE > i) {
-            buffer_ptr[read_bytes++] = block[i];
-            if (bytes == read_bytes) {
-                file_des_table[fd].offset += read_bytes;
-                return read_bytes;
+    while (bytes > read_bytes) {
+        int pos = offset + read_bytes;
+        int chunk = bytes - read_bytes;
+        if (NULL != buf_ptr->data && buf_ptr->base <= pos && buf_ptr->base + buf_ptr->len > pos) {
+            //read bytes still held in the delayed allocation buffer
+            if (buf_ptr->base + buf_ptr->len - pos < chunk) {
+                chunk = buf_ptr->base + buf_ptr->len - pos;
+            }
+            memcpy(buffer_ptr + read_bytes, buf_ptr->data + (pos - buf_ptr->base), chunk);
+        } else {
+            //read the file blocks on disk, up to one arena buffer at a time so consecutive blocks go out as one request
+            int skip = pos % BLOCK_CHUNK_SIZE;
+            if (ARENA_SLOT_BLOCKS * BLOCK_CHUNK_SIZE - skip < chunk) {
+                chunk = ARENA_SLOT_BLOCKS * BLOCK_CHUNK_SIZE - skip;
+            }
+            if (NULL != buf_ptr->data && buf_ptr->base > pos && buf_ptr->base - pos < chunk) {
+                chunk = buf_ptr->base - pos;
             }
-            i++;
+            if (NULL == block && NULL == (block = arena_get())) {
+                errno = ENOMEM;
+                return -errno;
+            }
+            int count = (skip + chunk + BLOCK_CHUNK_SIZE - 1) / BLOCK_CHUNK_SIZE;
+            if (0 > file_blocks_io(f_index, pos / BLOCK_CHUNK_SIZE, count, block, read_blocks)) {
+                arena_put(block);
+                errno = EIO;
+                return -errno;
+            }
+            memcpy(buffer_ptr + read_bytes, block + skip, chunk);
         }
-        blocks++;
+        read_bytes += chunk;
+    }
+    if (NULL != block) {
+        arena_put(block);
     }
     file_des_table[fd].offset += read_bytes;
     return read_bytes;
@@ -286,14 +864,14 @@ int wo_read(int fd,  void* buffer, int bytes) {
  */
 
 /**
- * wo_write() : write bytes from buffer to file
+ * fs_write() : write bytes from buffer to file
  * 
  * @param fd : file descriptor
  * @param buffer : memory location to write bytes from
  * @param bytes : number of bytes to write
  * @return int : bytes written on success, any negative number on error
  */
-int wo_write(int fd,  void* buffer, int bytes) {
+int fs_write(int fd,  void* buffer, int bytes) {
     //check for valid file descriptor
     if(0 >= bytes || !file_des_table[fd].fd_in_use) {
         errno = ENOENT;
@@ -301,102 +879,57 @@ int wo_write(int fd,  void* buffer, int bytes) {
     }
     char f_index = file_des_table[fd].findex;
     inode* file_ptr = &inode_ptr[f_index];
-    int size = file_ptr->fsize;
+    file_buf* buf_ptr = &file_buf_table[f_index];
     int offset = file_des_table[fd].offset;
-    int b_index = file_ptr->fhead;
-    int blocks = 0;
-
-    //current block position
-    while (BLOCK_CHUNK_SIZE <= offset) {
-        b_index = search_next_block(b_index, f_index);
-        offset -= BLOCK_CHUNK_SIZE;
-        blocks++;
-    }
-    char *buffer_ptr = buffer;
-    int write_bytes = 0;
-    char block[BLOCK_CHUNK_SIZE] = "";
-    if (-1 != b_index) {
-        //write current block
-        read_block(b_index, block);
-        int i = offset;
-        while (BLOCK_CHUNK_SIZE > i) {
-            block[i] = buffer_ptr[write_bytes++];
-            if (bytes == write_bytes || strlen(buffer_ptr) == write_bytes) {
-                write_block(b_index, block);
-                file_des_table[fd].offset += write_bytes;
-                if(size < file_des_table[fd].offset){
-                    file_ptr->fsize = file_des_table[fd].offset;
-                }
-                return write_bytes;
-            }
-            i++;
-        }
-        write_block(b_index, block);
-        blocks++;
+    if ((NO_OF_MAP_ENTRIES - FIRST_DATA_BLOCK) * BLOCK_CHUNK_SIZE < offset + bytes) {
+        errno = EFBIG;
+        return -errno;
     }
 
-    //write next blocks
-    strcpy(block, "");
-    while ((bytes > write_bytes) && ((strlen(buffer_ptr)) > write_bytes) && ((file_ptr->fblock_count) > blocks)) {
-        b_index = search_next_block(b_index, f_index);
-        int i = 0;
-        while (BLOCK_CHUNK_SIZE > i) {
-            block[i] = buffer_ptr[write_bytes++];
-            if (bytes == write_bytes || strlen(buffer_ptr) == write_bytes) {
-                write_block(b_index, block);
-                file_des_table[fd].offset += write_bytes;
-                if(size < file_des_table[fd].offset){
-                    file_ptr->fsize = file_des_table[fd].offset;
-                }
-                return write_bytes;
+    //blocks are allocated on close/sync, so fail now if the buffered data could never be allocated
+    int size = (file_ptr->fsize > offset + bytes) ? file_ptr->fsize : offset + bytes;
+    int pending = pending_blocks(f_index, size);
+    if (0 < pending && (NULL == buf_ptr->data || size > file_ptr->fsize)) {
+        for (char f = 0; f < NO_OF_FILES; f++) {
+            if (f != f_index && NULL != file_buf_table[f].data) {
+                pending += pending_blocks(f, inode_ptr[f].fsize);
             }
-            i++;
         }
-        write_block(b_index, block);
-        blocks++;
+        if (pending > free_blocks()) {
+            errno = ENOSPC;
+            return -errno;
+        }
     }
 
-    //write to new blocks
-    strcpy(block, "");
-    while (bytes > write_bytes && strlen(buffer_ptr) > write_bytes) {
-        b_index = search_available_block(f_index);
-        file_ptr->fblock_count++;
-        if (-1 == file_ptr->fhead) {
-            file_ptr->fhead = b_index;
-        }
-        if (0 > b_index){
-            return -1;
-        }
-        int i =0;
-        while (BLOCK_CHUNK_SIZE > i) {
-            block[i] = buffer_ptr[write_bytes++];
-            if (bytes == write_bytes || strlen(buffer_ptr) == write_bytes) {
-                write_block(b_index, block);
-                file_des_table[fd].offset += write_bytes;
-                if (size < file_des_table[fd].offset){
-                    file_ptr->fsize = file_des_table[fd].offset;
-                }
-                return write_bytes;
-            }
-            i++;
+    //flush the largest buffers under memory pressure before taking more bytes
+    while (0 < buffered_bytes && MAX_BUFFERED_BYTES < buffered_bytes + bytes) {
+        if (0 > flush_file(largest_buffer())) {
+            return -errno;
         }
-        write_block(b_index, block);
     }
 
-    file_des_table[fd].offset += write_bytes;
-    if(size < file_des_table[fd].offset){
+    //copy the bytes into the file's buffer
+    if (0 > buffer_file(f_index, offset, offset + bytes)) {
+        return -errno;
+    }
+    memcpy(buf_ptr->data + (offset - buf_ptr->base), buffer, bytes);
+    if (offset + bytes - buf_ptr->base > buf_ptr->len) {
+        buf_ptr->len = offset + bytes - buf_ptr->base;
+    }
+    file_des_table[fd].offset += bytes;
+    if (file_ptr->fsize < file_des_table[fd].offset) {
         file_ptr->fsize = file_des_table[fd].offset;
     }
-    return write_bytes;
+    return bytes;
 }
 
 /**
- * wo_close() : close file in the File System.
+ * fs_close() : close file in the File System.
  * 
  * @param fd : file descriptor
  * @return int : 0 on success, any negative number on error
  */
-int wo_close(int fd) {
+int fs_close(int fd) {
     //Check if the given filedescriptor is valid or has an entry in the current table of open file descriptors
     if(0 > fd || MAX_FILE_DESCRIPTORS <= fd || !file_des_table[fd].fd_in_use) {
         errno = ENOENT;
@@ -404,16 +937,162 @@ int wo_close(int fd) {
     }
     file_des* fds = &file_des_table[fd];
     fds->fd_in_use = NO;
+
+    //allocate and write out the buffered data once the last descriptor is closed
+    int i = 0;
+    while (MAX_FILE_DESCRIPTORS > i) {
+        if (YES == file_des_table[i].fd_in_use && fds->findex == file_des_table[i].findex) {
+            return 0;
+        }
+        i++;
+    }
+    if (0 > flush_file(fds->findex)) {
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * fs_sync() : allocate blocks for and write out all buffered data of a file
+ * 
+ * @param fd : file descriptor
+ * @return int : 0 on success, any negative number on error
+ */
+int fs_sync(int fd) {
+    if(0 > fd || MAX_FILE_DESCRIPTORS <= fd || !file_des_table[fd].fd_in_use) {
+        errno = ENOENT;
+        return -errno;
+    }
+    if (0 > flush_file(file_des_table[fd].findex)) {
+        return -errno;
+    }
     return 0;
 }
 
+/**
+ * fs_fallocate() : reserve blocks for a file to grow to len bytes without changing its size.
+ * The reservation is one contiguous run written to the block map once, later appends fill the
+ * reserved blocks without allocating.
+ * 
+ * @param fd : file descriptor
+ * @param len : file length in bytes to reserve blocks for
+ * @return int : 0 on success, any negative number on error
+ */
+int fs_fallocate(int fd, int len) {
+    if(0 > fd || MAX_FILE_DESCRIPTORS <= fd || !file_des_table[fd].fd_in_use) {
+        errno = ENOENT;
+        return -errno;
+    }
+    if (0 >= len) {
+        errno = EINVAL;
+        return -errno;
+    }
+    if ((NO_OF_MAP_ENTRIES - FIRST_DATA_BLOCK) * BLOCK_CHUNK_SIZE < len) {
+        errno = EFBIG;
+        return -errno;
+    }
+    char f_index = file_des_table[fd].findex;
+    inode* file_ptr = &inode_ptr[f_index];
+    file_buf* buf_ptr = &file_buf_table[f_index];
+    int blocks = (len + BLOCK_CHUNK_SIZE - 1) / BLOCK_CHUNK_SIZE;
+    if (0 > file_ptr->fshare && blocks <= file_ptr->fblock_count + file_ptr->freserved) {
+        return 0;
+    }
+
+    //allocate the reservation together with the file's buffered data
+    if (0 > buffer_file(f_index, file_ptr->fsize, file_ptr->fsize)) {
+        return -errno;
+    }
+    buf_ptr->reserve = blocks;
+    if (0 > flush_file(f_index)) {
+        buf_ptr->reserve = 0;
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * fs_clone() : create a copy of a file sharing the source's data blocks.
+ * Only metadata is written, either copy gets new blocks when it is next written (copy-on-write).
+ * 
+ * @param src_name : file name to copy
+ * @param dst_name : file name of the copy
+ * @return int : 0 on success, any negative number on error
+ */
+int fs_clone(char* src_name, char* dst_name) {
+    char src_index = search_file(src_name);
+    if (0 > src_index) {
+        errno = ENOENT;
+        return -errno;
+    }
+    if (0 <= search_file(dst_name)) {
+        errno = EEXIST;
+        return -errno;
+    }
+
+    //the clone shares what is on disk, so write out the source's buffered data first
+    if (0 > flush_file(src_index)) {
+        return -errno;
+    }
+    if (0 > wo_create(dst_name)) {
+        errno = ENOSPC;
+        return -errno;
+    }
+    char dst_index = search_file(dst_name);
+    inode* src_ptr = &inode_ptr[src_index];
+    inode* dst_ptr = &inode_ptr[dst_index];
+    dst_ptr->fsize = src_ptr->fsize;
+    if (0 < src_ptr->fblock_count) {
+        char owner = block_owner(src_index);
+        dst_ptr->fblock_count = src_ptr->fblock_count;
+        dst_ptr->fshare = owner;
+        inode_ptr[owner].fref++;
+    }
+    return 0;
+}
+
+/**
+ * fs_defrag() : defragment the mounted File System in small steps.
+ * Each step slides a few used blocks down into the lowest free hole or, once free space is
+ * coalesced, moves a fragmented file into the free tail a few blocks at a time. Call repeatedly until it returns 0.
+ * 
+ * @param max_usec : time budget for this call in microseconds
+ * @return int : 1 if more work remains, 0 when defragmented, any negative number on error
+ */
+int fs_defrag(int max_usec) {
+    if (!disk_open) {
+        errno = EACCES;
+        return -errno;
+    }
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int more = 1;
+    while (more) {
+        if (0 > (more = defrag_step())) {
+            return -errno;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (max_usec <= (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000) {
+            break;
+        }
+    }
+
+    //write the block map once for all steps
+    if (0 > write_blocks(sb_ptr->data_block_index, NO_OF_MAP_ENTRIES / BLOCK_CHUNK_SIZE, map_ptr)) {
+        errno = EACCES;
+        return -errno;
+    }
+    return more;
+}
+
 /**
  * ready_disk() : ready a disk for open/create from File System.
  * 
  * @param file_name : File System file name
+ * @param blocks : number of blocks held by the file
  * @return int : 0 on success, any negative number on error
  */
-int ready_disk(char *file_name) { 
+int ready_disk(char *file_name, int blocks) { 
   int f;
   char buffer[BLOCK_CHUNK_SIZE];
   if (!file_name) {
@@ -425,7 +1104,7 @@ int ready_disk(char *file_name) {
   }
   memset(buffer, 0, BLOCK_CHUNK_SIZE);
   int i = 0;
-  while (NO_OF_DISK_BLOCKS > i) {
+  while (blocks > i) {
     write(f, buffer, BLOCK_CHUNK_SIZE);
     i++;
   }
@@ -436,27 +1115,75 @@ int ready_disk(char *file_name) {
 /**
  * open_disk(): open a disk from File System.
  * 
- * @param file_name: File System file name 
+ * @param file_names: File System backing file names
+ * @param count: number of backing files
  * @return int : 0 on success, any negative number on error
  */
-int open_disk(char *file_name) {
+int open_disk(char **file_names, int count) {
   int f;
-  if (!file_name) {
+  if (!file_names) {
     return -1;
   }  
   if (disk_open) {
     errno = EEXIST;
     return -errno;
   }
-  if (0 > (f = open(file_name, O_RDWR, 0644))) {
-    errno = EACCES;
-    return -errno;
+  //bypass the page cache in direct mode, falling back where the file system does not support it
+  //or needs more than block alignment
+  direct_io = (io_flags & WO_DIRECT) ? 1 : 0;
+  int i = 0;
+  while (count > i) {
+    f = open(file_names[i], O_RDWR | (direct_io ? O_DIRECT : 0), 0644);
+    if (0 <= f && direct_io && !direct_aligned(f)) {
+      close(f);
+      f = -1;
+    }
+    if (0 > f) {
+      while (0 < i) {
+        close(disk_handles[--i]);
+      }
+      if (direct_io) {
+        direct_io = 0;
+        continue;
+      }
+      errno = EACCES;
+      return -errno;
+    }
+    disk_handles[i++] = f;
   }
+  stripe_count = count;
   disk_open = 1;
-  disk_handle = f;
+  if (1 < count) {
+    stripe_start();
+  }
   return 0;
 }
 
+/**
+ * direct_aligned() : check that a backing file opened with O_DIRECT accepts block sized I/O at block
+ * aligned offsets from block aligned buffers
+ * 
+ * @param handle : backing file handle
+ * @return int : 1 if direct I/O works with blocks, 0 otherwise
+ */
+int direct_aligned(int handle) {
+#ifdef STATX_DIOALIGN
+  struct statx stx;
+  if (0 == statx(handle, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) && (stx.stx_mask & STATX_DIOALIGN)) {
+    return 0 != stx.stx_dio_offset_align && 0 != stx.stx_dio_mem_align
+        && 0 == BLOCK_CHUNK_SIZE % stx.stx_dio_offset_align && 0 == BLOCK_CHUNK_SIZE % stx.stx_dio_mem_align;
+  }
+#endif
+  //alignment not reported, probe one block at an offset that is block but not page aligned
+  char *buffer = arena_get();
+  if (NULL == buffer) {
+    return 0;
+  }
+  int aligned = (BLOCK_CHUNK_SIZE == pread(handle, buffer, BLOCK_CHUNK_SIZE, BLOCK_CHUNK_SIZE));
+  arena_put(buffer);
+  return aligned;
+}
+
 /**
  * close_disk() : close the disk representing the File System 
  * 
@@ -466,8 +1193,13 @@ int close_disk() {
   if (!disk_open) {
     return -1;
   }
-  close(disk_handle);
-  disk_handle = disk_open = 0;
+  stripe_stop();
+  int i = 0;
+  while (stripe_count > i) {
+    close(disk_handles[i]);
+    disk_handles[i++] = 0;
+  }
+  disk_open = 0;
   return 0;
 }
 
@@ -479,20 +1211,10 @@ int close_disk() {
  * @return int : 0 on success, any negative number on error
  */
 int read_block(int block_index, char *buffer) {
-  if (!disk_open) {
-    errno = EACCES;
-    return -errno;
-  }
   if ((0 > block_index) || (NO_OF_DISK_BLOCKS <= block_index)) {
     return -1;
   }
-  if (0 > lseek(disk_handle, block_index*BLOCK_CHUNK_SIZE, SEEK_SET)) {
-    return -1;
-  }
-  if (0 > read(disk_handle, buffer, BLOCK_CHUNK_SIZE)) {
-    return -1;
-  }
-  return 0;
+  return read_blocks(block_index, 1, buffer);
 }
 
 /**
@@ -503,36 +1225,377 @@ int read_block(int block_index, char *buffer) {
  * @return int : 0 on success, any negative number on error
  */
 int write_block(int block_index, char *buffer) {
+  if ((0 > block_index) || (NO_OF_DISK_BLOCKS <= block_index)) {
+    return -1;
+  }
+  return write_blocks(block_index, 1, buffer);
+}
+
+/**
+ * read_blocks() : read a run of consecutive blocks to buffer in one request
+ * 
+ * @param block_index : first block index
+ * @param count : number of blocks
+ * @param buffer : buffer
+ * @return int : 0 on success, any negative number on error
+ */
+int read_blocks(int block_index, int count, char *buffer) {
   if (!disk_open) {
     errno = EACCES;
     return -errno;
   }
-  if ((0 > block_index) || (NO_OF_DISK_BLOCKS <= block_index)) {
+  if ((0 > block_index) || (0 >= count) || (NO_OF_DISK_BLOCKS < block_index + count)) {
     return -1;
   }
-  if (0 > lseek(disk_handle, block_index*BLOCK_CHUNK_SIZE, SEEK_SET)) {
+  if (direct_io && 0 != (uintptr_t)buffer % BLOCK_CHUNK_SIZE) {
+    return bounce_blocks(block_index, count, buffer, read_blocks);
+  }
+  return stripe_io(block_index, count, buffer, 0);
+}
+
+/**
+ * write_blocks() : write contents from buffer to a run of consecutive blocks in one request
+ * 
+ * @param block_index : first block index
+ * @param count : number of blocks
+ * @param buffer : buffer
+ * @return int : 0 on success, any negative number on error
+ */
+int write_blocks(int block_index, int count, char *buffer) {
+  if (!disk_open) {
+    errno = EACCES;
+    return -errno;
+  }
+  if ((0 > block_index) || (0 >= count) || (NO_OF_DISK_BLOCKS < block_index + count)) {
     return -1;
   }
-  if (0 > write(disk_handle, buffer, BLOCK_CHUNK_SIZE)) {
+  if (direct_io && 0 != (uintptr_t)buffer % BLOCK_CHUNK_SIZE) {
+    return bounce_blocks(block_index, count, buffer, write_blocks);
+  }
+  return stripe_io(block_index, count, buffer, 1);
+}
+
+/**
+ * stripe_io() : read/write a run of blocks across the backing files.
+ * Block b lives in stripe unit b / stripe_blocks, units are dealt round-robin to the backing files.
+ * Each backing file gets one vectored request, large runs are handed to the backing files' workers in parallel.
+ * 
+ * @param block_index : first block index
+ * @param count : number of blocks
+ * @param buffer : buffer
+ * @param write_flag : 1 to write, 0 to read
+ * @return int : 0 on success, any negative number on error
+ */
+int stripe_io(int block_index, int count, char *buffer, int write_flag) {
+  off_t offset = (off_t)block_index*BLOCK_CHUNK_SIZE;
+  if (1 == stripe_count) {
+    ssize_t done = write_flag ? pwrite(disk_handles[0], buffer, count*BLOCK_CHUNK_SIZE, offset)
+                              : pread(disk_handles[0], buffer, count*BLOCK_CHUNK_SIZE, offset);
+    return (count*BLOCK_CHUNK_SIZE == done) ? 0 : -1;
+  }
+
+  //split the run into stripe unit segments per backing file
+  int segments = (count / stripe_blocks + 2 + stripe_count - 1) / stripe_count;
+  stripe_request requests[MAX_STRIPES];
+  int i = 0;
+  while (stripe_count > i) {
+    requests[i].handle = disk_handles[i];
+    requests[i].write_flag = write_flag;
+    requests[i].iov = stripe_iov + i * segments;
+    requests[i].iov_count = 0;
+    requests[i].result = 0;
+    requests[i].finished = 0;
+    requests[i].next = NULL;
+    i++;
+  }
+  int done = 0;
+  int files = 0;
+  while (count > done) {
+    int b_index = block_index + done;
+    int unit = b_index / stripe_blocks;
+    int len = stripe_blocks - b_index % stripe_blocks;
+    if (count - done < len) {
+      len = count - done;
+    }
+    stripe_request *request = &requests[unit % stripe_count];
+    if (0 == request->iov_count) {
+      request->offset = ((off_t)(unit / stripe_count) * stripe_blocks + b_index % stripe_blocks) * BLOCK_CHUNK_SIZE;
+      files++;
+    }
+    request->iov[request->iov_count].iov_base = buffer + done*BLOCK_CHUNK_SIZE;
+    request->iov[request->iov_count].iov_len = len*BLOCK_CHUNK_SIZE;
+    request->iov_count++;
+    done += len;
+  }
+
+  //queue the backing files to their workers, the calling thread serves the last one
+  int queued[MAX_STRIPES] = {0};
+  int parallel = (1 < files && STRIPE_PARALLEL_BLOCKS <= count);
+  int result = 0;
+  for (i = 0; i < stripe_count; i++) {
+    if (0 == requests[i].iov_count) {
+      continue;
+    }
+    files--;
+    queued[i] = (parallel && 0 < files && stripe_queues[i].running);
+    if (queued[i]) {
+      stripe_submit(&stripe_queues[i], &requests[i]);
+    } else {
+      stripe_serve(&requests[i]);
+    }
+  }
+  for (i = 0; i < stripe_count; i++) {
+    if (queued[i]) {
+      stripe_wait(&stripe_queues[i], &requests[i]);
+    }
+    if (0 > requests[i].result) {
+      result = -1;
+    }
+  }
+  return result;
+}
+
+/**
+ * stripe_serve() : serve a striped I/O request on one backing file
+ * 
+ * @param req : request to serve, its result is set on return
+ */
+void stripe_serve(stripe_request *req) {
+  off_t offset = req->offset;
+  for (int i = 0; i < req->iov_count; i += IOV_MAX) {
+    int n = (IOV_MAX < req->iov_count - i) ? IOV_MAX : req->iov_count - i;
+    ssize_t expected = 0;
+    for (int j = i; j < i + n; j++) {
+      expected += req->iov[j].iov_len;
+    }
+    ssize_t done = req->write_flag ? pwritev(req->handle, req->iov + i, n, offset)
+                                   : preadv(req->handle, req->iov + i, n, offset);
+    if (expected != done) {
+      req->result = -1;
+      return;
+    }
+    offset += expected;
+  }
+  req->result = 0;
+}
+
+/**
+ * stripe_worker() : persistent worker of one backing file, serves queued requests until stopped
+ * 
+ * @param queue : stripe_queue of the backing file
+ * @return void* : NULL
+ */
+void *stripe_worker(void *queue) {
+  stripe_queue *q = (stripe_queue*)queue;
+  pthread_mutex_lock(&q->lock);
+  while (1) {
+    while (NULL == q->head && !q->stop) {
+      pthread_cond_wait(&q->wake, &q->lock);
+    }
+    if (NULL == q->head) {
+      break;
+    }
+    stripe_request *req = q->head;
+    q->head = req->next;
+    if (NULL == q->head) {
+      q->tail = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+    stripe_serve(req);
+    pthread_mutex_lock(&q->lock);
+    req->finished = 1;
+    pthread_cond_broadcast(&q->done);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+/**
+ * stripe_start() : start one worker per backing file, files without a worker are served by the caller
+ */
+void stripe_start() {
+  for (int i = 0; i < stripe_count; i++) {
+    stripe_queue *q = &stripe_queues[i];
+    memset(q, 0, sizeof(stripe_queue));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wake, NULL);
+    pthread_cond_init(&q->done, NULL);
+    q->running = (0 == pthread_create(&q->thread, NULL, stripe_worker, q));
+  }
+}
+
+/**
+ * stripe_stop() : stop the backing file workers once their queues are drained
+ */
+void stripe_stop() {
+  for (int i = 0; i < MAX_STRIPES; i++) {
+    stripe_queue *q = &stripe_queues[i];
+    if (!q->running) {
+      continue;
+    }
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->thread, NULL);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->wake);
+    pthread_cond_destroy(&q->done);
+    q->running = 0;
+  }
+}
+
+/**
+ * stripe_submit() : append a request to a backing file worker's queue
+ * 
+ * @param queue : stripe_queue of the backing file
+ * @param req : request to serve
+ */
+void stripe_submit(stripe_queue *queue, stripe_request *req) {
+  pthread_mutex_lock(&queue->lock);
+  if (NULL == queue->tail) {
+    queue->head = req;
+  } else {
+    queue->tail->next = req;
+  }
+  queue->tail = req;
+  pthread_cond_signal(&queue->wake);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * stripe_wait() : wait for a backing file worker to serve a submitted request
+ * 
+ * @param queue : stripe_queue of the backing file
+ * @param req : request submitted with stripe_submit()
+ */
+void stripe_wait(stripe_queue *queue, stripe_request *req) {
+  pthread_mutex_lock(&queue->lock);
+  while (!req->finished) {
+    pthread_cond_wait(&queue->done, &queue->lock);
+  }
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * bounce_blocks() : read/write blocks for an unaligned buffer through an aligned arena buffer
+ * 
+ * @param block_index : first block index
+ * @param count : number of blocks
+ * @param buffer : unaligned buffer
+ * @param block_io : read_blocks or write_blocks
+ * @return int : 0 on success, any negative number on error
+ */
+int bounce_blocks(int block_index, int count, char *buffer, int (*block_io)(int, int, char *)) {
+  char *bounce = arena_get();
+  if (NULL == bounce) {
+    errno = ENOMEM;
+    return -errno;
+  }
+  while (0 < count) {
+    int chunk = (ARENA_SLOT_BLOCKS < count) ? ARENA_SLOT_BLOCKS : count;
+    if (write_blocks == block_io) {
+      memcpy(bounce, buffer, chunk*BLOCK_CHUNK_SIZE);
+    }
+    if (0 > block_io(block_index, chunk, bounce)) {
+      arena_put(bounce);
+      return -1;
+    }
+    if (read_blocks == block_io) {
+      memcpy(buffer, bounce, chunk*BLOCK_CHUNK_SIZE);
+    }
+    block_index += chunk;
+    buffer += chunk*BLOCK_CHUNK_SIZE;
+    count -= chunk;
+  }
+  arena_put(bounce);
+  return 0;
+}
+
+/**
+ * arena_init() : preallocate the page aligned block buffer arena and thread its buffers on the free list
+ * 
+ * @param huge_pages : back the arena with a huge page when available
+ * @return int : 0 on success, any negative number on error
+ */
+int arena_init(int huge_pages) {
+  if (NULL != arena_ptr) {
+    return 0;
+  }
+  void *arena = MAP_FAILED;
+  arena_huge = 0;
+  if (huge_pages) {
+    arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    arena_huge = (MAP_FAILED != arena);
+  }
+  if (MAP_FAILED == arena) {
+    arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (MAP_FAILED == arena) {
     return -1;
   }
+  arena_ptr = (char*)arena;
+  arena_free = NULL;
+  for (int i = ARENA_SIZE / (ARENA_SLOT_BLOCKS * BLOCK_CHUNK_SIZE) - 1; i >= 0; i--) {
+    arena_put(arena_ptr + i * ARENA_SLOT_BLOCKS * BLOCK_CHUNK_SIZE);
+  }
   return 0;
 }
 
+/**
+ * arena_release() : unmap the block buffer arena
+ */
+void arena_release() {
+  if (NULL != arena_ptr) {
+    munmap(arena_ptr, ARENA_SIZE);
+  }
+  arena_ptr = arena_free = NULL;
+}
+
+/**
+ * arena_get() : take a buffer of ARENA_SLOT_BLOCKS blocks from the arena free list
+ * 
+ * @return char* : aligned buffer on success, NULL if the arena is exhausted
+ */
+char *arena_get() {
+  char *buffer = arena_free;
+  if (NULL != buffer) {
+    memcpy(&arena_free, buffer, sizeof(char*));
+  }
+  return buffer;
+}
+
+/**
+ * arena_put() : return a buffer to the arena free list
+ * 
+ * @param buffer : buffer taken with arena_get()
+ */
+void arena_put(char *buffer) {
+  memcpy(buffer, &arena_free, sizeof(char*));
+  arena_free = buffer;
+}
+
 /**
  * disk_init() : initialize structures for accessing disk.
  * 
- * @param file_name : File System file name
+ * @param file_names : File System backing file names
+ * @param count : number of backing files
+ * @param unit : stripe unit in blocks
  * @param mem_address : address to read the entire 'disk' in to
  * @return int : 0 on success, any negative number on error
  */
-int disk_init(char *file_name, void *mem_address) {
-    if (ready_disk(file_name)) {
-        errno = EACCES;
-        return -errno;
+int disk_init(char **file_names, int count, int unit, void *mem_address) {
+    //each backing file holds every count-th stripe unit
+    int units = (NO_OF_DISK_BLOCKS + unit - 1) / unit;
+    for (int i = 0; i < count; i++) {
+        if (ready_disk(file_names[i], ((units - i + count - 1) / count) * unit)) {
+            errno = EACCES;
+            return -errno;
+        }
     }
-    if (open_disk(file_name)) {
-        errno = (EEXIST == open_disk(file_name)) ? EEXIST: EACCES;
+    stripe_blocks = unit;
+    if (open_disk(file_names, count)) {
+        errno = (EEXIST == open_disk(file_names, count)) ? EEXIST: EACCES;
         return -errno;
     }
     
@@ -543,15 +1606,43 @@ int disk_init(char *file_name, void *mem_address) {
     }
     sb_ptr->inode_block_index = 1;
     sb_ptr->inode_block_size = 0;
-    sb_ptr->data_block_index = 2;
+    sb_ptr->data_block_index = 1 + NO_OF_INODE_BLOCKS;
+    sb_ptr->fs_magic = FILE_SYSTEM_MAGIC;
+    sb_ptr->stripe_count = count;
+    sb_ptr->stripe_blocks = unit;
     memset(mem_address, 0, BLOCK_CHUNK_SIZE);
-    memcpy(mem_address, &sb_ptr, sizeof(super_block));
-    if (0 > write_block(0, mem_address)) {
+    memcpy(mem_address, sb_ptr, sizeof(super_block));
+    int result = write_block(0, mem_address);
+    free(sb_ptr);
+    sb_ptr = NULL;
+    close_disk();
+    if (0 > result) {
         errno = EACCES;
         return -errno;
     }
-    free(sb_ptr);
-    close_disk();
+    return 0;
+}
+
+/**
+ * check_disk() : check whether a disk already holds a File System.
+ * 
+ * @param file_name : File System file name
+ * @param mem_address : address to read the super block in to
+ * @return int : 0 if the disk is formatted, any negative number otherwise
+ */
+int check_disk(char *file_name, void *mem_address) {
+    int f;
+    if (0 > (f = open(file_name, O_RDONLY))) {
+        return -1;
+    }
+    memset(mem_address, 0, BLOCK_CHUNK_SIZE);
+    int count = read(f, mem_address, BLOCK_CHUNK_SIZE);
+    close(f);
+    super_block disk_sb;
+    memcpy(&disk_sb, mem_address, sizeof(super_block));
+    if (BLOCK_CHUNK_SIZE != count || FILE_SYSTEM_MAGIC != disk_sb.fs_magic) {
+        return -1;
+    }
     return 0;
 }
 
@@ -598,70 +1689,605 @@ int available_file_des(char file_index) {
  * @return int : next block index on success, any negative number on error
  */
 int search_next_block(int current_block_index, char file_index) {
-    char buffer[BLOCK_CHUNK_SIZE] = "";
-    if (BLOCK_CHUNK_SIZE > current_block_index) {
-        if (0 > read_block(sb_ptr->data_block_index, buffer)) {
-            errno = EACCES;
-            return -errno;
+    for (int i = current_block_index + 1; i < NO_OF_MAP_ENTRIES; i++) {
+        if ((file_index + 1) == map_ptr[i]) {
+            return i;
         }
-        for (int i = current_block_index + 1; i < BLOCK_CHUNK_SIZE; i++) {
-            if ((file_index + 1) == buffer[i]) {
-                return i;
+    }
+    return -1;
+}
+
+/**
+ * search_available_run() : search first run of consecutive free data blocks
+ * 
+ * @param start : first block index to search from
+ * @param count : number of blocks in the run
+ * @return int : first block of the run on success, any negative number on error
+ */
+int search_available_run(int start, int count) {
+    int run = 0;
+    for (int i = (FIRST_DATA_BLOCK > start) ? FIRST_DATA_BLOCK : start; i < NO_OF_MAP_ENTRIES; i++) {
+        run = ('\0' == map_ptr[i]) ? run + 1 : 0;
+        if (count == run) {
+            return i - count + 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * free_blocks() : count the data blocks not owned by any file
+ * 
+ * @return int : number of free data blocks
+ */
+int free_blocks() {
+    int count = 0;
+    for (int i = FIRST_DATA_BLOCK; i < NO_OF_MAP_ENTRIES; i++) {
+        if ('\0' == map_ptr[i]) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * pending_blocks() : count the free blocks the next flush of a file takes.
+ * A shared file is written to new blocks, any other file reuses the blocks it owns.
+ * 
+ * @param file_index : file index
+ * @param size : file size the flush allocates blocks for
+ * @return int : number of free blocks taken
+ */
+int pending_blocks(char file_index, int size) {
+    inode* file_ptr = &inode_ptr[file_index];
+    int need = (size + BLOCK_CHUNK_SIZE - 1) / BLOCK_CHUNK_SIZE;
+    if (0 <= file_ptr->fshare || 0 < file_ptr->fref) {
+        return need;
+    }
+    int have = file_ptr->fblock_count + file_ptr->freserved;
+    return (need > have) ? need - have : 0;
+}
+
+/**
+ * block_owner() : find the file owning the data blocks of a file, clones read their source's blocks
+ * 
+ * @param file_index : file index
+ * @return char : owner file index
+ */
+char block_owner(char file_index) {
+    return (0 <= inode_ptr[file_index].fshare) ? (char)inode_ptr[file_index].fshare : file_index;
+}
+
+/**
+ * file_block() : find the disk block holding a block of a file
+ * 
+ * @param file_index : file index
+ * @param block_no : block number within the file
+ * @return int : block index on success, any negative number on error
+ */
+int file_block(char file_index, int block_no) {
+    char owner = block_owner(file_index);
+    int b_index = inode_ptr[owner].fhead;
+    while (0 < block_no && 0 <= b_index) {
+        b_index = search_next_block(b_index, owner);
+        block_no--;
+    }
+    return b_index;
+}
+
+/**
+ * file_blocks_io() : read/write blocks of a file, merging consecutive disk blocks into one request
+ * 
+ * @param file_index : file index
+ * @param first : first block number within the file
+ * @param count : number of blocks
+ * @param buffer : buffer holding count blocks
+ * @param block_io : read_blocks or write_blocks
+ * @return int : 0 on success, any negative number on error
+ */
+int file_blocks_io(char file_index, int first, int count, char *buffer, int (*block_io)(int, int, char *)) {
+    int b_index = file_block(file_index, first);
+    int run_start = b_index;
+    int run_len = 0;
+    while (0 < count) {
+        if (0 > b_index) {
+            return -1;
+        }
+        if (run_start + run_len != b_index) {
+            if (0 > block_io(run_start, run_len, buffer)) {
+                return -1;
             }
+            buffer += run_len * BLOCK_CHUNK_SIZE;
+            run_start = b_index;
+            run_len = 0;
         }
-    } else {
-        if (0 > read_block(sb_ptr->data_block_index + 1, buffer)) {
-            errno = EACCES;
+        run_len++;
+        count--;
+        if (0 < count) {
+            b_index = search_next_block(b_index, block_owner(file_index));
+        }
+    }
+    if (0 < run_len && 0 > block_io(run_start, run_len, buffer)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * buffer_file() : make the delayed allocation buffer of a file cover a byte range about to be written.
+ * Only the partially written first and last blocks are loaded from disk, the caller fills the rest.
+ * 
+ * @param file_index : file index
+ * @param start : first file offset to cover
+ * @param end : file offset past the last byte to cover
+ * @return int : 0 on success, any negative number on error
+ */
+int buffer_file(char file_index, int start, int end) {
+    inode* file_ptr = &inode_ptr[file_index];
+    file_buf* buf_ptr = &file_buf_table[file_index];
+
+    //a buffer holds one run of file bytes, write it out before covering a range apart from it
+    if (NULL != buf_ptr->data && (buf_ptr->base > start || buf_ptr->base + buf_ptr->len < start)) {
+        if (0 > flush_file(file_index)) {
             return -errno;
         }
-        for (int i = current_block_index - BLOCK_CHUNK_SIZE + 1; i < BLOCK_CHUNK_SIZE; i++) {
-            if ((file_index + 1) == buffer[i]){
-                return i + BLOCK_CHUNK_SIZE;
+    }
+
+    //start a new buffer at the block holding start, loading that block if start is inside it
+    if (NULL == buf_ptr->data) {
+        int base = (start / BLOCK_CHUNK_SIZE) * BLOCK_CHUNK_SIZE;
+        int cap = (end - base + BLOCK_CHUNK_SIZE - 1) / BLOCK_CHUNK_SIZE;
+        if (0 == cap) {
+            cap = 1;
+        }
+        cap *= BLOCK_CHUNK_SIZE;
+        buf_ptr->data = (char*)aligned_alloc(BLOCK_CHUNK_SIZE, cap);
+        if (NULL == buf_ptr->data) {
+            errno = ENOMEM;
+            return -errno;
+        }
+        memset(buf_ptr->data, 0, cap);
+        buf_ptr->base = base;
+        buf_ptr->len = 0;
+        buf_ptr->cap = cap;
+        buffered_bytes += cap;
+        if (base < start) {
+            if (0 > file_blocks_io(file_index, base / BLOCK_CHUNK_SIZE, 1, buf_ptr->data, read_blocks)) {
+                drop_buffer(file_index);
+                errno = EIO;
+                return -errno;
             }
+            buf_ptr->len = (file_ptr->fsize - base < BLOCK_CHUNK_SIZE) ? file_ptr->fsize - base : BLOCK_CHUNK_SIZE;
         }
     }
-    return -1;
+
+    //grow the buffer, doubling to keep appends cheap
+    if (end - buf_ptr->base > buf_ptr->cap) {
+        int cap = buf_ptr->cap;
+        while (end - buf_ptr->base > cap) {
+            cap *= 2;
+        }
+        char *data = (char*)aligned_alloc(BLOCK_CHUNK_SIZE, cap);
+        if (NULL == data) {
+            errno = ENOMEM;
+            return -errno;
+        }
+        memcpy(data, buf_ptr->data, buf_ptr->cap);
+        memset(data + buf_ptr->cap, 0, cap - buf_ptr->cap);
+        free(buf_ptr->data);
+        buffered_bytes += cap - buf_ptr->cap;
+        buf_ptr->data = data;
+        buf_ptr->cap = cap;
+    }
+
+    //load the block holding end if end is inside file bytes not yet buffered
+    int last = (end / BLOCK_CHUNK_SIZE) * BLOCK_CHUNK_SIZE;
+    if (last < end && end < file_ptr->fsize && buf_ptr->base + buf_ptr->len <= last) {
+        if (0 > file_blocks_io(file_index, last / BLOCK_CHUNK_SIZE, 1, buf_ptr->data + (last - buf_ptr->base), read_blocks)) {
+            errno = EIO;
+            return -errno;
+        }
+        buf_ptr->len = ((file_ptr->fsize < last + BLOCK_CHUNK_SIZE) ? file_ptr->fsize : last + BLOCK_CHUNK_SIZE) - buf_ptr->base;
+    }
+    return 0;
 }
 
 /**
- * search_available_block() : search available data block for writing file
+ * flush_file() : allocate blocks for the buffered data of a file and write it out.
+ * Blocks are allocated in one contiguous run sized to the final file length (or the reservation
+ * made with wo_fallocate(), whichever is larger) whenever possible. A file that cannot grow in
+ * place and is already fragmented, or finds no such run, only gets its new blocks after its last
+ * block, so a flush never rewrites the whole file unless the map order leaves no other choice.
  * 
  * @param file_index : file index
- * @return int : available data block number on success, any negative number on error
+ * @return int : 0 on success, any negative number on error
  */
-int search_available_block(char file_index) {
-    char buffer1[BLOCK_CHUNK_SIZE] = "";
-    char buffer2[BLOCK_CHUNK_SIZE] = "";
-    if (0 > read_block(sb_ptr->data_block_index, buffer1)) {
-        errno = EACCES;
-        return -errno;
+int flush_file(char file_index) {
+    inode* file_ptr = &inode_ptr[file_index];
+    file_buf* buf_ptr = &file_buf_table[file_index];
+    if (NULL == buf_ptr->data) {
+        return 0;
     }
-    if (0 > read_block(sb_ptr->data_block_index + 1, buffer2)) {
-        errno = EACCES;
-        return -errno;
+    int need = (file_ptr->fsize + BLOCK_CHUNK_SIZE - 1) / BLOCK_CHUNK_SIZE;
+    int have = file_ptr->fblock_count + file_ptr->freserved;
+    int first = buf_ptr->base / BLOCK_CHUNK_SIZE;
+    int shared = (0 <= file_ptr->fshare || 0 < file_ptr->fref);
+
+    //blocks to own after the flush: the data blocks, plus any reserved blocks not yet filled
+    int total = (!shared && have > need) ? have : need;
+    if (buf_ptr->reserve > total) {
+        total = buf_ptr->reserve;
     }
 
-    for (int i = 4; i < BLOCK_CHUNK_SIZE; i++) {
-        if ('\0' == buffer1[i]) {
-            buffer1[i] = (char)(file_index + 1);
-            if (0 > write_block(sb_ptr->data_block_index, buffer1)) {
-                errno = EACCES;
+    //shared blocks are never written in place, the writer gets new blocks (copy-on-write)
+    if (total > have || shared) {
+        int last = (0 < have) ? file_block(file_index, have - 1) : -1;
+        int grow = total - have;
+        int after = 0;
+        int head = -1;
+        int i = 0;
+        if (!shared && 0 < have) {
+            //a file's blocks are ordered by map position, new blocks can only go after its last block
+            for (i = last + 1; i < NO_OF_MAP_ENTRIES; i++) {
+                if ('\0' == map_ptr[i]) {
+                    after++;
+                }
+            }
+            head = search_available_run(last + 1, grow);
+        }
+        int contiguous = (0 < have && file_ptr->fhead + have - 1 == last);
+        if (!shared && 0 < have && (last + 1 == head
+                || (grow <= after && (!contiguous || 0 > search_available_run(FIRST_DATA_BLOCK, total))))) {
+            //extend the file in place, else add the new blocks as one run (or the lowest free blocks) after it
+            int count = 0;
+            for (i = (0 <= head) ? head : last + 1; grow > count; i++) {
+                if ('\0' == map_ptr[i]) {
+                    map_ptr[i] = (char)(file_index + 1);
+                    count++;
+                }
+            }
+        } else {
+            //relocate the whole file into a single run, or to the lowest free blocks if nothing is left after it
+            if (total > (shared ? 0 : have) + free_blocks()) {
+                errno = ENOSPC;
                 return -errno;
             }
-            return i;
+            //the whole file moves, load the blocks before and after the buffered ones
+            int count = (buf_ptr->len + BLOCK_CHUNK_SIZE - 1) / BLOCK_CHUNK_SIZE;
+            if (0 < first || first + count < need) {
+                int cap = need * BLOCK_CHUNK_SIZE;
+                char *data = (char*)aligned_alloc(BLOCK_CHUNK_SIZE, cap);
+                if (NULL == data) {
+                    errno = ENOMEM;
+                    return -errno;
+                }
+                if ((0 < first && 0 > file_blocks_io(file_index, 0, first, data, read_blocks))
+                        || (first + count < need && 0 > file_blocks_io(file_index, first + count, need - first - count,
+                            data + (first + count) * BLOCK_CHUNK_SIZE, read_blocks))) {
+                    free(data);
+                    errno = EIO;
+                    return -errno;
+                }
+                memcpy(data + first * BLOCK_CHUNK_SIZE, buf_ptr->data, count * BLOCK_CHUNK_SIZE);
+                free(buf_ptr->data);
+                buffered_bytes += cap - buf_ptr->cap;
+                buf_ptr->data = data;
+                buf_ptr->base = 0;
+                buf_ptr->len = file_ptr->fsize;
+                buf_ptr->cap = cap;
+                first = 0;
+            }
+            if (0 <= file_ptr->fshare) {
+                //detach the clone from its source's blocks
+                inode_ptr[file_ptr->fshare].fref--;
+                file_ptr->fshare = -1;
+            } else if (0 < file_ptr->fref) {
+                //hand the shared blocks over to the first clone, which becomes their owner
+                char heir = -1;
+                for (char f = 0; f < NO_OF_FILES; f++) {
+                    if (YES == inode_ptr[f].file_in_use && file_index == inode_ptr[f].fshare) {
+                        if (0 > heir) {
+                            heir = f;
+                            inode_ptr[f].fshare = -1;
+                            inode_ptr[f].fref = file_ptr->fref - 1;
+                            inode_ptr[f].fhead = file_ptr->fhead;
+                            inode_ptr[f].freserved = file_ptr->freserved;
+                        } else {
+                            inode_ptr[f].fshare = heir;
+                        }
+                    }
+                }
+                for (i = FIRST_DATA_BLOCK; i < NO_OF_MAP_ENTRIES; i++) {
+                    if ((file_index + 1) == map_ptr[i]) {
+                        map_ptr[i] = (char)(heir + 1);
+                    }
+                }
+                file_ptr->fref = 0;
+                file_ptr->freserved = 0;
+            }
+            for (i = FIRST_DATA_BLOCK; i < NO_OF_MAP_ENTRIES; i++) {
+                if ((file_index + 1) == map_ptr[i]) {
+                    map_ptr[i] = '\0';
+                }
+            }
+            head = search_available_run(FIRST_DATA_BLOCK, total);
+            if (0 <= head) {
+                for (i = head; i < head + total; i++) {
+                    map_ptr[i] = (char)(file_index + 1);
+                }
+            } else {
+                //free space is too fragmented, fall back to the lowest free blocks
+                int count = 0;
+                for (i = FIRST_DATA_BLOCK; total > count; i++) {
+                    if ('\0' == map_ptr[i]) {
+                        map_ptr[i] = (char)(file_index + 1);
+                        if (0 == count) {
+                            head = i;
+                        }
+                        count++;
+                    }
+                }
+            }
+            file_ptr->fhead = head;
+        }
+        if (0 > write_blocks(sb_ptr->data_block_index, NO_OF_MAP_ENTRIES / BLOCK_CHUNK_SIZE, map_ptr)) {
+            errno = EACCES;
+            return -errno;
         }
     }
-    for (int i = 0; i < BLOCK_CHUNK_SIZE; i++) {
-        if ('\0' == buffer2[i]) {
-            buffer2[i] = (char)(file_index + 1);
-            if (0 > write_block(sb_ptr->data_block_index, buffer2)) {
-                errno = EACCES;
-                return -errno;
+
+    //appends fill reserved blocks without touching the block map
+    file_ptr->fblock_count = need;
+    file_ptr->freserved = total - need;
+
+    //write the buffered blocks
+    int count = (buf_ptr->len + BLOCK_CHUNK_SIZE - 1) / BLOCK_CHUNK_SIZE;
+    if (0 < count && 0 > file_blocks_io(file_index, first, count, buf_ptr->data, write_blocks)) {
+        errno = EIO;
+        return -errno;
+    }
+    drop_buffer(file_index);
+    return 0;
+}
+
+/**
+ * drop_buffer() : discard the delayed allocation buffer of a file that cannot be written out,
+ * the file keeps the bytes held in its blocks on disk
+ * 
+ * @param file_index : file index
+ */
+void drop_buffer(char file_index) {
+    inode* file_ptr = &inode_ptr[file_index];
+    file_buf* buf_ptr = &file_buf_table[file_index];
+    if (file_ptr->fblock_count * BLOCK_CHUNK_SIZE < file_ptr->fsize) {
+        file_ptr->fsize = file_ptr->fblock_count * BLOCK_CHUNK_SIZE;
+    }
+    buffered_bytes -= buf_ptr->cap;
+    free(buf_ptr->data);
+    memset(buf_ptr, 0, sizeof(file_buf));
+}
+
+/**
+ * largest_buffer() : find the file holding the largest delayed allocation buffer
+ * 
+ * @return int : file index
+ */
+int largest_buffer() {
+    int largest = 0;
+    for (int i = 1; i < NO_OF_FILES; i++) {
+        if (file_buf_table[i].cap > file_buf_table[largest].cap) {
+            largest = i;
+        }
+    }
+    return largest;
+}
+
+/**
+ * defrag_step() : move at most DEFRAG_STEP_BLOCKS blocks towards a compact layout.
+ * Blocks only ever move past free blocks, so each file keeps its block order in the map.
+ * 
+ * @return int : 1 if blocks were moved, 0 if there is nothing left to do, any negative number on error
+ */
+int defrag_step() {
+    //carry on moving the file whose new run is still free, the writes since the last step may have taken it
+    if (0 <= defrag_file) {
+        inode* file_ptr = &inode_ptr[defrag_file];
+        int valid = (YES == file_ptr->file_in_use && 0 > file_ptr->fshare
+                && defrag_count == file_ptr->fblock_count + file_ptr->freserved);
+        for (int i = defrag_dest; valid && i < defrag_dest + defrag_count; i++) {
+            valid = (map_ptr[i] == ((i < defrag_dest + defrag_count - defrag_moved) ? '\0' : (char)(defrag_file + 1)));
+        }
+        if (valid) {
+            return defrag_move();
+        }
+        defrag_file = -1;
+    }
+
+    int hole = -1;
+    int used = -1;
+    for (int i = FIRST_DATA_BLOCK; i < NO_OF_MAP_ENTRIES; i++) {
+        if ('\0' == map_ptr[i]) {
+            if (0 > hole) {
+                hole = i;
             }
-            return i;
+        } else if (0 <= hole) {
+            used = i;
+            break;
         }
     }
-    return -1;
+
+    //slide the used blocks after the lowest hole down into it
+    if (0 <= used) {
+        int count = 0;
+        while (DEFRAG_STEP_BLOCKS > count && NO_OF_MAP_ENTRIES > used + count && '\0' != map_ptr[used + count]) {
+            count++;
+        }
+        char *buffer = arena_get();
+        if (NULL == buffer) {
+            errno = ENOMEM;
+            return -errno;
+        }
+        if (0 > read_blocks(used, count, buffer) || 0 > write_blocks(hole, count, buffer)) {
+            arena_put(buffer);
+            errno = EIO;
+            return -errno;
+        }
+        arena_put(buffer);
+        for (int i = 0; i < count; i++) {
+            char owner = map_ptr[used + i];
+            if (inode_ptr[owner - 1].fhead == used + i) {
+                inode_ptr[owner - 1].fhead = hole + i;
+            }
+            map_ptr[used + i] = '\0';
+            map_ptr[hole + i] = owner;
+        }
+        return 1;
+    }
+
+    //free space is coalesced, start moving the first fragmented file that fits into the free tail
+    int tail = (0 <= hole) ? hole : NO_OF_MAP_ENTRIES;
+    for (char f = 0; f < NO_OF_FILES; f++) {
+        inode* file_ptr = &inode_ptr[f];
+        int count = file_ptr->fblock_count + file_ptr->freserved;
+        if (YES != file_ptr->file_in_use || 0 <= file_ptr->fshare || 1 >= count || NO_OF_MAP_ENTRIES - tail < count) {
+            continue;
+        }
+        if (file_ptr->fhead + count - 1 == file_block(f, count - 1)) {
+            continue;
+        }
+        defrag_file = f;
+        defrag_dest = tail;
+        defrag_count = count;
+        defrag_moved = 0;
+        return defrag_move();
+    }
+    return 0;
+}
+
+/**
+ * defrag_move() : move the last blocks of the file being defragmented that are not yet in its new run.
+ * The new run lies above every block in use, so the moved blocks stay after the ones left behind.
+ * 
+ * @return int : 1 on success, any negative number on error
+ */
+int defrag_move() {
+    int count = defrag_count - defrag_moved;
+    if (DEFRAG_STEP_BLOCKS < count) {
+        count = DEFRAG_STEP_BLOCKS;
+    }
+    int first = defrag_count - defrag_moved - count;
+    char *buffer = arena_get();
+    if (NULL == buffer) {
+        errno = ENOMEM;
+        return -errno;
+    }
+    if (0 > file_blocks_io(defrag_file, first, count, buffer, read_blocks)
+            || 0 > write_blocks(defrag_dest + first, count, buffer)) {
+        arena_put(buffer);
+        errno = EIO;
+        return -errno;
+    }
+    arena_put(buffer);
+    int b_index = file_block(defrag_file, first);
+    for (int i = 0; i < count; i++) {
+        int next = search_next_block(b_index, defrag_file);
+        map_ptr[b_index] = '\0';
+        map_ptr[defrag_dest + first + i] = (char)(defrag_file + 1);
+        b_index = next;
+    }
+    if (0 == first) {
+        inode_ptr[defrag_file].fhead = defrag_dest;
+    }
+    defrag_moved += count;
+    if (defrag_count == defrag_moved) {
+        defrag_file = -1;
+    }
+    return 1;
+}
+
+/**
+ * trace_clock() : read the monotonic clock
+ * 
+ * @return long long : time in nanoseconds
+ */
+long long trace_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * trace_call() : append a trace record for a finished call to the trace buffer
+ * 
+ * @param op : traced call
+ * @param start : call start time from trace_clock()
+ * @param fd : file descriptor argument
+ * @param bytes : size argument
+ * @param result : return value
+ * @param names : file name arguments, stored one after another separated by '\0'
+ * @param count : number of file names
+ * @param fl : open flags, or the I/O mode of a mount
+ * @param m : open mode, or the number of backing files of a striped mount
+ */
+void trace_call(int op, long long start, int fd, int bytes, int result, char **names, int count, int fl, int m) {
+    char name[UCHAR_MAX];
+    int name_len = 0;
+    for (int i = 0; i < count && UCHAR_MAX > name_len; i++) {
+        int len = (NULL == names[i]) ? 0 : strlen(names[i]);
+        if (0 < i) {
+            name[name_len++] = '\0';
+        }
+        if (UCHAR_MAX - name_len < len) {
+            len = UCHAR_MAX - name_len;
+        }
+        if (0 < len) {
+            memcpy(name + name_len, names[i], len);
+        }
+        name_len += len;
+    }
+    trace_record record;
+    memset(&record, 0, sizeof(record));
+    record.op = (unsigned char)op;
+    record.name_len = (unsigned char)name_len;
+    record.fl = (unsigned char)fl;
+    record.m = (unsigned char)m;
+    record.fd = fd;
+    record.bytes = bytes;
+    record.result = result;
+    record.start_ns = start - trace_epoch;
+    record.latency_ns = trace_clock() - start;
+    if (TRACE_BUFFER_SIZE - trace_len < (int)sizeof(record) + record.name_len) {
+        trace_flush();
+    }
+    memcpy(trace_buffer + trace_len, &record, sizeof(record));
+    if (0 < record.name_len) {
+        memcpy(trace_buffer + trace_len + sizeof(record), name, record.name_len);
+    }
+    trace_len += sizeof(record) + record.name_len;
+}
+
+/**
+ * trace_flush() : write the trace buffer to the trace log
+ * 
+ * @return int : 0 on success, any negative number on error
+ */
+int trace_flush() {
+    int len = trace_len;
+    trace_len = 0;
+    if (0 < len && len != write(trace_handle, trace_buffer, len)) {
+        errno = EIO;
+        return -errno;
+    }
+    return 0;
+}
+
+/**
+ * trace_exit() : complete the trace log when the process exits without stopping the trace
+ */
+void trace_exit() {
+    if (0 <= trace_handle) {
+        wo_trace_stop();
+    }
 }
 
 /**
@@ -682,6 +2308,9 @@ int wo_create(char *file_name) {
                 inode_ptr[i].fsize = 0;
                 inode_ptr[i].fhead = -1;
                 inode_ptr[i].fblock_count = 0;
+                inode_ptr[i].fshare = -1;
+                inode_ptr[i].fref = 0;
+                inode_ptr[i].freserved = 0;
                 return 0;
             }
         }